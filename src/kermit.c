@@ -15,12 +15,25 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE /* ptsname_r */
 #include "kermit.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <glib-unix.h>
+#include <glib/gstdio.h>
 #include <locale.h>
+#define PCRE2_CODE_UNIT_WIDTH 0
+#include <pcre2.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <strings.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <termios.h>
+#include <unistd.h>
 #include <vte/vte.h>
 
 #define UNUSED(x) (void)(x)
@@ -34,12 +47,6 @@
                       .blue = CLR_16(CLR_B(x)),  \
                       .alpha = a }
 
-static GtkWidget *window;                            /* Main window widget */
-static GtkWidget *paned;                             /* Paned widged for the tab feature */
-static GtkWidget *notebook;                          /* Notebook widget for the tab feature */
-static GtkWidget *tabLabel;                          /* Label widget for the tab feature */
-static PangoFontDescription *fontDesc;               /* Description for the terminal font */
-static FILE *configFile;                             /* Terminal configuration file */
 static float termOpacity = TERM_OPACITY;             /* Default opacity value */
 static int defaultFontSize = TERM_FONT_DEFAULT_SIZE; /* Terminal font size */
 static int termBackground = TERM_BACKGROUND;         /* Background color */
@@ -48,66 +55,301 @@ static int termBoldColor = TERM_BOLD_COLOR;          /* Foreground bold color */
 static int termCursorColor = TERM_CURSOR_COLOR;      /* Cursor color */
 static int termCursorFg = TERM_CURSOR_FG;            /* Cursor foreground color */
 static int termCursorShape = VTE_CURSOR_SHAPE_BLOCK; /* Cursor shape*/
-static int currentFontSize;                          /* Necessary for changing font size */
+static long termScrollback = TERM_SCROLLBACK;        /* Scrollback lines (-1 -> unlimited) */
+static long termScrollbackBytes = 0;                 /* Scrollback budget in bytes */
 static int keyState;                                 /* State of key press events */
 static int actionKey = GDK_MOD1_MASK;                /* Key to check on press */
 static int tabPosition = 0;                          /* Tab position (0/1 -> bottom/top) */
-static int keyCount = 0;                             /* Count of custom binding keys */
+static int prespawnCount = 0;                        /* Size of the warm terminal pool */
+static int sessionInterval = 0;                      /* Seconds between session snapshots */
+static int throttleInterval = 0;                     /* Milliseconds between hidden tab reads */
+static int hibernateInterval = 0;                    /* Idle seconds before hibernating a tab */
+static int termRewrap = TERM_REWRAP_LAZY;            /* Rewrap on resize (TERM_REWRAP_*) */
+static int termRender = TERM_RENDER_AUTO;            /* Window visual (TERM_RENDER_*) */
+static gboolean autoReload = TRUE;                   /* Reload on config file changes */
+static gboolean logAll = FALSE;                      /* Log the output of every tab */
+static gboolean logCompress = FALSE;                 /* Compress the logs with gzip */
+static char *logDir;                                 /* Directory of the logs */
+static int sessionLines = 0;                         /* Scrollback lines in the session */
+static long pasteConfirm = 0;                        /* Paste size that needs a confirmation */
+static gboolean pasteBracketed = FALSE;              /* Bracket the streamed pastes */
 static int colorCount = 0;                           /* Parsed color count */
 static int opt;                                      /* Argument parsing option */
 static char *termFont = TERM_FONT;                   /* Default terminal font */
 static char *termLocale = TERM_LOCALE;               /* Terminal locale (numeric) */
 static char *termWordChars = TERM_WORD_CHARS;        /* Word characters exceptions */
 static char *termTitle;                              /* Title to set in terminal (-t) */
-static char *wordChars;                              /* Variables for parsing the config */
-static char *fontSize;
+static char *wordChars;                              /* Parsed word chars */
+static char *termFontName;                           /* Parsed terminal font */
+static int configLine;                               /* Line number of the config file */
 static char *configFileName; /* Configuration file name */
 static char *workingDir;     /* Working directory */
 static char *termCommand;    /* Command to execute in terminal (-e) */
-static char *tabLabelText;   /* The label text for showing the tabs situation */
-static gchar **envp;         /* Variables for starting the terminal */
-static gchar **command;
+static char *socketPath;     /* Path of the single-instance server socket */
+static char *sessionPath;    /* Path of the session snapshots */
+static char *configPath;     /* Path of the parsed configuration file */
 static gboolean defaultConfigFile = TRUE; /* Boolean value for -c argument */
 static gboolean debugMessages = FALSE;    /* Boolean value for -d argument */
-static gboolean closeTab = FALSE;         /* Close the tab on child-exited signal */
-static va_list vargs;                     /* Hold information about variable arguments */
+static gboolean serverMode = FALSE;       /* Boolean value for -s argument */
+static gboolean tabRequest = FALSE;       /* Boolean value for -T argument */
+static gboolean backgroundRequest = FALSE; /* Boolean value for -B argument */
+static gboolean benchMode = FALSE;        /* Boolean value for -b argument */
+static gboolean statsRequest = FALSE;     /* Boolean value for -S argument */
+static gboolean headlessMode = FALSE;     /* Boolean value for -H argument */
+static int headlessInterval = 0;          /* Milliseconds between the headless frames */
+static int headlessStatus = 0;            /* Exit status of the headless command */
+static gboolean startupTrace = FALSE;     /* Boolean value for -P argument */
+static int serverSocket = -1;             /* Listening socket of the server */
+typedef struct {                          /* Client of the server socket */
+    int fd;
+    GString *request;
+    GString *reply;                       /* Reply (NULL while reading the request) */
+    gsize offset;                         /* Written bytes of the reply */
+    guint watch;                          /* Watch of the socket */
+    guint timeout;                        /* Timer for dropping the client */
+} Client;
 static GdkRGBA termPalette[TERM_PALETTE_SIZE];   /* Terminal colors */
-static char **args;                       /* Save args the terminal was launched with*/
+static guint configGeneration = 1;        /* Incremented on configuration changes */
+static guint applySource = 0;             /* Idle source for applying the configuration */
+static guint applyChanges = 0;            /* Pending changes to apply (TERM_CHANGE_*) */
+static guint reloadSource = 0;            /* Timer for the debounced reload */
+static GFileMonitor *configMonitor;       /* Monitor of the configuration file */
+static GAsyncQueue *logQueue;             /* Messages for the log writer thread */
+static GThread *logThread;                /* Log writer thread */
+static guint logCount = 0;                /* Count of the started logs */
+typedef struct {                          /* Output log of a terminal */
+    char *path;
+    gboolean compress;
+    glong row;                            /* Next row to write */
+    GOutputStream *stream;                /* Owned by the writer thread */
+} TermLog;
+typedef struct {                          /* Rows of the scrollback (immutable) */
+    gint refCount;
+    glong row;                            /* First row */
+    char *text;                           /* Rows separated by newlines */
+    gsize length;
+    GArray *offsets;                      /* Offsets of the rows in the text */
+} SearchBlock;
+typedef struct {                          /* Scrollback index of a terminal */
+    GPtrArray *blocks;                    /* Blocks ordered by row */
+    glong end;                            /* End of the indexed rows */
+    glong columns;                        /* Column count of the indexed rows */
+} SearchIndex;
+typedef struct Search {                   /* Scrollback search of a window */
+    gint refCount;
+    GRegex *regex;
+    VteRegex *vteRegex;                   /* Same pattern for the highlight */
+    GCancellable *cancellable;
+    TermWindow *termWindow;
+    GtkWidget *terminal;                  /* Weak pointer */
+    GArray *matches;                      /* Rows of the matches (ordered) */
+    int current;                          /* Index of the current match */
+    glong indexStart;                     /* First row of the scrollback */
+    glong indexEnd;                       /* Rows to index */
+    guint indexSource;                    /* Idle source for indexing */
+    guint pendingJobs;                    /* Blocks in the worker thread */
+} Search;
+typedef struct {                          /* Block to search in the worker thread */
+    Search *search;
+    SearchBlock *block;
+    GArray *rows;                         /* Rows of the matches */
+} SearchJob;
+static GThreadPool *searchPool;           /* Worker thread for the searches */
+struct SessionSnapshot {                  /* Session snapshot for the writer thread */
+    guint32 tabCount;
+    GByteArray *data;                     /* Literal run that is appended */
+    GPtrArray *parts;                     /* Literal runs between the scrollbacks (GBytes) */
+    GPtrArray *terminals;                 /* Terminals of the scrollbacks */
+    GPtrArray *texts;                     /* Scrollback texts of the terminals (GBytes) */
+};
+typedef struct {                          /* Message for the log writer thread */
+    int type;                             /* TERM_LOG_* */
+    TermLog *log;
+    GBytes *data;
+    SessionSnapshot *snapshot;            /* Snapshot of TERM_LOG_SESSION */
+} LogMessage;
+static guint poolSource = 0;              /* Idle source for refilling the warm pool */
+static guint throttleSource = 0;          /* Timer for reading the hidden tabs */
+static int throttleActive = 0;            /* Interval of the running throttle timer */
+static int throttleWoken = 0;             /* Hidden terminals in the time slice */
+static guint hibernateSource = 0;         /* Timer for hibernating the idle tabs */
+static int hibernateActive = 0;           /* Idle time of the running hibernation timer */
+static GQueue warmPool = G_QUEUE_INIT;    /* Terminals with prespawned shells */
+static GBytes *lastSession;               /* Layout of the last written snapshot */
+static guint sessionOutput = 0;           /* Count of the output changes */
+static guint lastSessionOutput = 0;       /* Output changes at the last snapshot */
+static gint sessionFailed = 0;            /* Last snapshot is not written (atomic) */
+typedef struct Paste {                    /* Paste that is streamed to the PTY */
+    GtkWidget *terminal;                  /* Weak pointer */
+    char *data;
+    gsize size;
+    gsize offset;                         /* Written bytes */
+    guint watch;                          /* Watch for the writable PTY */
+} Paste;
+typedef struct {                          /* Broadcast input of a terminal */
+    GtkWidget *terminal;
+    GByteArray *pending;                  /* Input that is not written yet */
+    guint watch;                          /* Watch for the writable PTY */
+} Broadcast;
+static GPtrArray *broadcastTerms;         /* Terminals in the broadcast (Broadcast) */
+static guint broadcastSource = 0;         /* Idle source for writing the broadcast */
+typedef struct {                          /* Arguments for spawning the shells */
+    guint generation;                     /* Configuration generation of the spec */
+    char *shell;
+    char *argv[2];                        /* Shell without arguments */
+    char *dir;                            /* Default working directory */
+} SpawnSpec;
+static SpawnSpec spawnSpec;               /* Shared by the tabs, panes and warm pool */
+typedef struct {                          /* Pane of a lazy tab */
+    char *dir;
+    char *command;
+    char *title;
+    GBytes *scrollback;                   /* Compressed scrollback text */
+    guint32 scrollbackSize;               /* Uncompressed scrollback size */
+} LazyPane;
+typedef struct {                          /* Tab that is spawned on the first switch */
+    char *layout;                         /* Layout of the split panes (NULL for one) */
+    GPtrArray *panes;                     /* Panes in the layout order (LazyPane) */
+} LazyTab;
+typedef struct {                          /* Phase of the startup trace */
+    const char *phase;
+    gint64 time;
+} StartupMark;
+static GArray *startupMarks;              /* Startup phases until the first output */
+enum {                                    /* Instrumented hot paths */
+    STAT_KEY_PRESS,
+    STAT_TAB_SWITCH,
+    STAT_CONFIGURE,
+    STAT_SPAWN,
+    STAT_FIRST_OUTPUT,
+    STAT_CHILD_EXIT,
+    STAT_COUNT
+};
+typedef struct {                          /* Counter and timing histogram */
+    const char *name;
+    guint64 count;
+    gint64 total;
+    gint64 max;
+    guint64 buckets[TERM_STAT_BUCKETS];   /* Durations by powers of two (us) */
+} Stat;
+static Stat stats[STAT_COUNT] = {
+    [STAT_KEY_PRESS] = { .name = "termOnKeyPress" },
+    [STAT_TAB_SWITCH] = { .name = "termTabOnSwitch" },
+    [STAT_CONFIGURE] = { .name = "configureTerm" },
+    [STAT_SPAWN] = { .name = "spawn" },
+    [STAT_FIRST_OUTPUT] = { .name = "spawnToFirstOutput" },
+    [STAT_CHILD_EXIT] = { .name = "termOnChildExit" },
+};
+typedef struct {                          /* Trace event */
+    int stat;
+    gint64 start;
+    gint64 duration;
+} TraceEvent;
+typedef struct {                          /* Output sample of a terminal */
+    gint64 time;
+    glong row;                            /* End of the rows at the time */
+} TermSample;
+typedef struct {                          /* State of the resource report */
+    GString *json;
+    int window;
+    int tab;
+    int terminals;
+    long rows;
+    long bytes;
+} Report;
+static GArray *traceEvents;               /* Ring of the latest trace events */
+static guint traceCount = 0;              /* Count of the recorded trace events */
+typedef struct {                          /* Resolved theme shared by the terminals */
+    guint generation;                     /* Configuration generation of the theme */
+    GdkRGBA palette[TERM_PALETTE_SIZE];
+    GdkRGBA foreground;
+    GdkRGBA background;
+    GdkRGBA bold;
+    GdkRGBA cursor;
+    GdkRGBA cursorFg;
+    PangoFontDescription *font;
+} Theme;
+static Theme theme;
+struct TermWindow {                       /* Terminal window struct */
+    GtkWidget *window;                    /* Window widget */
+    GtkWidget *paned;                     /* Paned widget for the tab feature */
+    GtkWidget *notebook;                  /* Notebook widget for the tab feature */
+    GtkWidget *tabLabel;                  /* Label widget for the tab feature */
+    char *title;                          /* Title to set in window */
+    char *command;                        /* Command to execute in new tabs */
+    GString *tabMarkup;                   /* Markup of the tabs label */
+    GArray *tabOffsets;                   /* Offsets of the tab colors in markup */
+    int tabActive;                        /* Highlighted tab in markup */
+    gboolean tabDirty;                    /* Rebuild the markup on next switch */
+    GtkWidget *searchBar;                 /* Box of the search entry and label */
+    GtkWidget *searchEntry;               /* Entry of the search pattern */
+    GtkWidget *searchLabel;               /* Label of the match count */
+    guint searchSource;                   /* Timer for searching after typing */
+    struct Search *search;                /* Running search */
+    int resizeHeight;                     /* Height of the last allocation */
+    int resizeWidth;                      /* Width of the last allocation */
+    guint resizeTick;                     /* Tick callback for the divider position */
+    guint settleSource;                   /* Timer for the end of the resize */
+    GtkWidget *pasteBar;                  /* Progress of the streaming paste */
+    struct Paste *paste;                  /* Streaming paste */
+    GtkWidget *box;                       /* Box of the paned and the bars */
+    guint barsSource;                     /* Idle source for creating the bars */
+    char *titlePending;                   /* Title to set on the next frame */
+    guint titleTick;                      /* Tick callback for the title */
+};
+static GPtrArray *termWindows;            /* Open terminal windows */
+static TermWindow *lastWindow;            /* Last focused terminal window */
+typedef void (*Action)(GtkWidget *terminal); /* Internal action handler */
 typedef struct KeyBindings {              /* Key bindings struct */
     gboolean internal;
     char *key;
     char *cmd;
+    Action action;
 } Bindings;
 typedef struct {       /* Default key bindings struct */
     Bindings bind;
     gboolean invalid;
 } DefaultBindings;
-static Bindings keyBindings[TERM_CONFIG_LENGTH]; /* Array for custom key bindings */
+static GArray *keyBindings;                 /* Custom key bindings of the configuration */
+typedef struct {                            /* Pattern of the match option */
+    char *pattern;
+    char *command;                          /* Command to open the matched text with */
+    GRegex *regex;                          /* Anchored regex for the clicked text */
+} MatchPattern;
+static GPtrArray *matchPatterns;            /* Patterns of the configuration (NULL for URLs) */
+static MatchPattern urlPattern = { TERM_MATCH_URL, TERM_MATCH_COMMAND, NULL };
+static struct {                             /* Regex of all patterns shared by the terminals */
+    guint generation;
+    GString *source;
+    VteRegex *regex;
+} matchRegex;
+static GStringChunk *bindingStrings;        /* Arena for the strings of the key bindings */
 static DefaultBindings defaultKeyBindings[] = {     /* Preconfigured default key bindings */
     { .bind = { .key = "c", .cmd = "copy", .internal = TRUE } },
     { .bind = { .key = "v", .cmd = "paste", .internal = TRUE } },
     { .bind = { .key = "t", .cmd = "new-tab", .internal = TRUE } },
     { .bind = { .key = "n", .cmd = "new-window", .internal = TRUE } },
-    { .bind = { .key = "return", .cmd = "new-tab", .internal = TRUE } },
+    { .bind = { .key = "Return", .cmd = "new-tab", .internal = TRUE } },
     { .bind = { .key = "r", .cmd = "reload-config", .internal = TRUE } },
     { .bind = { .key = "d", .cmd = "default-config", .internal = TRUE } },
     { .bind = { .key = "q", .cmd = "exit", .internal = TRUE } },
     { .bind = { .key = "k", .cmd = "inc-font-size", .internal = TRUE } },
-    { .bind = { .key = "up", .cmd = "inc-font-size", .internal = TRUE } },
+    { .bind = { .key = "Up", .cmd = "inc-font-size", .internal = TRUE } },
     { .bind = { .key = "j", .cmd = "dec-font-size", .internal = TRUE } },
-    { .bind = { .key = "down", .cmd = "dec-font-size", .internal = TRUE } },
-    { .bind = { .key = "equals", .cmd = "default-font-size", .internal = TRUE } },
+    { .bind = { .key = "Down", .cmd = "dec-font-size", .internal = TRUE } },
+    { .bind = { .key = "equal", .cmd = "default-font-size", .internal = TRUE } },
     { .bind = { .key = "plus", .cmd = "default-font-size", .internal = TRUE } },
     { .bind = { .key = "l", .cmd = "next-tab", .internal = TRUE } },
-    { .bind = { .key = "right", .cmd = "next-tab", .internal = TRUE } },
-    { .bind = { .key = "page_down", .cmd = "next-tab", .internal = TRUE } },
+    { .bind = { .key = "Right", .cmd = "next-tab", .internal = TRUE } },
+    { .bind = { .key = "Page_Down", .cmd = "next-tab", .internal = TRUE } },
     { .bind = { .key = "h", .cmd = "prev-tab", .internal = TRUE } },
-    { .bind = { .key = "left", .cmd = "prev-tab", .internal = TRUE } },
-    { .bind = { .key = "page_up", .cmd = "prev-tab", .internal = TRUE } },
+    { .bind = { .key = "Left", .cmd = "prev-tab", .internal = TRUE } },
+    { .bind = { .key = "Page_Up", .cmd = "prev-tab", .internal = TRUE } },
     { .bind = { .key = "w", .cmd = "close-tab", .internal = TRUE } },
-    { .bind = { .key = "backspace", .cmd = "close-tab", .internal = TRUE } },
+    { .bind = { .key = "BackSpace", .cmd = "close-tab", .internal = TRUE } },
 };
 static size_t defaultKeyCount = sizeof(defaultKeyBindings) / sizeof(DefaultBindings);
+static GHashTable *keyTable;                        /* Key bindings by key value */
 
 /*!
  * Print log (debug) message with format specifiers.
@@ -124,6 +366,7 @@ static int printLog(char *format, ...) {
             TERM_ATTR_COLOR,    /* Light blue */
             TERM_ATTR_DEFAULT); /* Default color */
                                 /* Format the string & print */
+    va_list vargs;
     va_start(vargs, format);
     vfprintf(stderr, format, vargs);
     va_end(vargs);
@@ -132,6 +375,236 @@ static int printLog(char *format, ...) {
     return 0;
 }
 
+/*!
+ * Get the start time for a statistic (only with debug messages).
+ *
+ * \return monotonic time (0 if the statistics are disabled)
+ */
+static gint64 statStart() {
+    return debugMessages ? g_get_monotonic_time() : 0;
+}
+
+/*!
+ * Record the duration since start into the statistic and trace.
+ *
+ * \param stat
+ * \param start
+ */
+static void recordStat(int stat, gint64 start) {
+    if (!debugMessages || start == 0)
+        return;
+    gint64 duration = g_get_monotonic_time() - start;
+    int bucket = 0;
+    while (bucket < TERM_STAT_BUCKETS - 1 && (1 << bucket) <= duration)
+        bucket++;
+    stats[stat].count++;
+    stats[stat].total += duration;
+    stats[stat].max = MAX(stats[stat].max, duration);
+    stats[stat].buckets[bucket]++;
+    /* Keep the latest events for the trace */
+    if (traceEvents == NULL)
+        traceEvents = g_array_sized_new(FALSE, FALSE, sizeof(TraceEvent), TERM_TRACE_MAX);
+    TraceEvent event = { .stat = stat, .start = start, .duration = duration };
+    if (traceEvents->len < TERM_TRACE_MAX)
+        g_array_append_val(traceEvents, event);
+    else
+        g_array_index(traceEvents, TraceEvent, traceCount % TERM_TRACE_MAX) = event;
+    traceCount++;
+}
+
+/*!
+ * Write the file into the runtime directory.
+ *
+ * \param name (file name suffix)
+ * \param contents
+ */
+static void writeStatFile(const char *name, GString *contents) {
+    GError *error = NULL;
+    gchar *fileName = g_strdup_printf("%s-%d-%s", TERM_NAME, getpid(), name);
+    gchar *path = g_build_filename(g_get_user_runtime_dir(), fileName, NULL);
+    if (g_file_set_contents(path, contents->str, contents->len, &error)) {
+        printLog("written: %s\n", path);
+    } else {
+        printLog("An error occurred: %s\n", error->message);
+        g_clear_error(&error);
+    }
+    g_free(path);
+    g_free(fileName);
+}
+
+/*!
+ * Export the counters and timing histograms as JSON (SIGUSR1).
+ *
+ * \param userData
+ * \return TRUE for keeping the source
+ */
+static gboolean exportStats(gpointer userData) {
+    UNUSED(userData);
+    GString *json = g_string_new("{");
+    for (int i = 0; i < STAT_COUNT; i++) {
+        g_string_append_printf(json,
+                               "%s\"%s\":{\"count\":%" G_GUINT64_FORMAT ","
+                               "\"total_us\":%" G_GINT64_FORMAT ","
+                               "\"max_us\":%" G_GINT64_FORMAT ",\"histogram_us\":{",
+                               i ? "," : "", stats[i].name, stats[i].count,
+                               stats[i].total, stats[i].max);
+        /* Bucket upper bounds are powers of two */
+        for (int j = 0; j < TERM_STAT_BUCKETS; j++)
+            g_string_append_printf(json, "%s\"%d\":%" G_GUINT64_FORMAT,
+                                   j ? "," : "", 1 << j, stats[i].buckets[j]);
+        g_string_append(json, "}}");
+    }
+    g_string_append(json, "}\n");
+    writeStatFile("stats.json", json);
+    g_string_free(json, TRUE);
+    return G_SOURCE_CONTINUE;
+}
+
+/*!
+ * Export the recorded events as Chrome/Perfetto trace (SIGUSR2).
+ *
+ * \param userData
+ * \return TRUE for keeping the source
+ */
+static gboolean exportTrace(gpointer userData) {
+    UNUSED(userData);
+    GString *json = g_string_new("{\"traceEvents\":[");
+    for (guint i = 0; traceEvents != NULL && i < traceEvents->len; i++) {
+        /* Start from the oldest event of the ring */
+        guint index = traceCount > TERM_TRACE_MAX ? (traceCount + i) % TERM_TRACE_MAX : i;
+        TraceEvent *event = &g_array_index(traceEvents, TraceEvent, index);
+        g_string_append_printf(json,
+                               "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%" G_GINT64_FORMAT
+                               ",\"dur\":%" G_GINT64_FORMAT ",\"pid\":%d,\"tid\":1}",
+                               i ? "," : "", stats[event->stat].name,
+                               event->start, event->duration, getpid());
+    }
+    g_string_append(json, "]}\n");
+    writeStatFile("trace.json", json);
+    g_string_free(json, TRUE);
+    return G_SOURCE_CONTINUE;
+}
+
+/*!
+ * Append the string to the JSON document.
+ *
+ * \param json
+ * \param value (NULL for null)
+ */
+static void appendJsonString(GString *json, const char *value) {
+    if (value == NULL) {
+        g_string_append(json, "null");
+        return;
+    }
+    g_string_append_c(json, '"');
+    for (const char *c = value; *c; c++) {
+        if (*c == '"' || *c == '\\')
+            g_string_append_printf(json, "\\%c", *c);
+        else if ((guchar)*c < 0x20)
+            g_string_append_printf(json, "\\u%04x", *c);
+        else
+            g_string_append_c(json, *c);
+    }
+    g_string_append_c(json, '"');
+}
+
+/*!
+ * Append the resource usage of the terminal to the report.
+ *
+ * \param terminal
+ * \param report
+ */
+static void reportTerm(GtkWidget *terminal, gpointer report) {
+    Report *state = report;
+    GtkAdjustment *adjustment = gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(terminal));
+    glong upper = (glong)gtk_adjustment_get_upper(adjustment);
+    glong rows = upper - (glong)gtk_adjustment_get_lower(adjustment);
+    glong columns = vte_terminal_get_column_count(VTE_TERMINAL(terminal));
+    gint64 now = g_get_monotonic_time();
+    /* Output rate since the previous report */
+    TermSample *sample = g_object_get_data(G_OBJECT(terminal), TERM_DATA_SAMPLE);
+    double rate = 0;
+    if (sample == NULL) {
+        sample = g_new0(TermSample, 1);
+        g_object_set_data_full(G_OBJECT(terminal), TERM_DATA_SAMPLE, sample, g_free);
+    } else if (now > sample->time) {
+        rate = (upper - sample->row) * G_USEC_PER_SEC / (double)(now - sample->time);
+    }
+    sample->time = now;
+    sample->row = upper;
+    state->rows += rows;
+    state->bytes += rows * columns * TERM_CELL_SIZE;
+    g_string_append_printf(state->json, "%s{\"window\":%d,\"tab\":%d,\"pid\":%d,\"title\":",
+                           state->terminals++ ? "," : "", state->window, state->tab,
+                           GPOINTER_TO_INT(g_object_get_data(G_OBJECT(terminal), TERM_DATA_PID)));
+    appendJsonString(state->json, vte_terminal_get_window_title(VTE_TERMINAL(terminal)));
+    g_string_append_printf(state->json, ",\"scrollback_rows\":%ld,\"scrollback_bytes\":%ld,"
+                           "\"rows_per_second\":%.1f,\"bytes_per_second\":%.0f}",
+                           rows, rows * columns * TERM_CELL_SIZE, rate, rate * columns);
+}
+
+/*!
+ * Get the resource report of all windows, tabs and terminals.
+ *
+ * Scrollback bytes are approximated with the cells of the rows and
+ * the output rate with the new rows since the previous report.
+ *
+ * \return report (JSON)
+ */
+static GString *getReport() {
+    Report state = { .json = g_string_new("{\"terminals\":[") };
+    int tabs = 0;
+    for (int i = 0; termWindows != NULL && i < termWindows->len; i++) {
+        GtkNotebook *notebook =
+            GTK_NOTEBOOK(((TermWindow *)g_ptr_array_index(termWindows, i))->notebook);
+        state.window = i;
+        for (int j = 0; j < gtk_notebook_get_n_pages(notebook); j++, tabs++) {
+            state.tab = j;
+            forEachTerm(gtk_notebook_get_nth_page(notebook, j), reportTerm);
+        }
+    }
+    /* Resident memory of the process */
+    long pages = 0;
+    gchar *statm = NULL;
+    if (g_file_get_contents("/proc/self/statm", &statm, NULL, NULL))
+        sscanf(statm, "%*d %ld", &pages);
+    g_free(statm);
+    g_string_append_printf(state.json, "],\"windows\":%u,\"tabs\":%d,\"terminal_count\":%d,"
+                           "\"warm_pool\":%u,\"scrollback_rows\":%ld,"
+                           "\"scrollback_bytes\":%ld,\"rss_bytes\":%ld}\n",
+                           termWindows != NULL ? termWindows->len : 0, tabs,
+                           state.terminals, g_queue_get_length(&warmPool), state.rows,
+                           state.bytes, pages * sysconf(_SC_PAGESIZE));
+    return state.json;
+}
+
+/*!
+ * Get the terminal window that contains the given widget.
+ *
+ * \param widget
+ * \return window (NULL if the widget is not in a terminal window)
+ */
+static TermWindow *getTermWindow(GtkWidget *widget) {
+    GtkWidget *toplevel = gtk_widget_get_toplevel(widget);
+    if (!gtk_widget_is_toplevel(toplevel))
+        return NULL;
+    return g_object_get_data(G_OBJECT(toplevel), TERM_NAME);
+}
+
+/*!
+ * Count the output changes for the session snapshots and mark the
+ * terminal as busy for the throttle.
+ *
+ * \param terminal
+ * \param userData
+ */
+static void termOnSessionOutput(VteTerminal *terminal, gpointer userData) {
+    UNUSED(userData);
+    sessionOutput++;
+    if (throttleActive > 0)
+        g_object_set_data(G_OBJECT(terminal), TERM_DATA_OUTPUT, GINT_TO_POINTER(TRUE));
+}
+
 /*!
  * Set signals for terminal.
  *
@@ -142,633 +615,5367 @@ static int connectSignals(GtkWidget *terminal) {
     g_signal_connect(terminal, "child-exited", G_CALLBACK(termOnChildExit), NULL);
     g_signal_connect(terminal, "key-press-event", G_CALLBACK(termOnKeyPress), NULL);
     g_signal_connect(terminal, "window-title-changed", G_CALLBACK(termOnTitleChanged),
-                     GTK_WINDOW(window));
+                     NULL);
+    g_signal_connect(terminal, "button-press-event", G_CALLBACK(termOnButtonPress), NULL);
+    g_signal_connect(terminal, "contents-changed", G_CALLBACK(termOnSessionOutput), NULL);
+    g_signal_connect_after(terminal, "size-allocate", G_CALLBACK(termOnAllocate), NULL);
     return 0;
 }
 
+/*!
+ * Get the current working directory of the terminal.
+ *
+ * The directory is reported by the shell with OSC 7 (vte.sh),
+ * otherwise the directory of the spawn is used.
+ *
+ * \param terminal
+ * \return directory (free with g_free, NULL if unknown)
+ */
+static gchar *getTermDir(GtkWidget *terminal) {
+    const char *uri = vte_terminal_get_current_directory_uri(VTE_TERMINAL(terminal));
+    gchar *dir = uri != NULL ? g_filename_from_uri(uri, NULL, NULL) : NULL;
+    return dir ?: g_strdup(g_object_get_data(G_OBJECT(terminal), TERM_DATA_DIR));
+}
+
 /*!
  * Opens a new window with the same working directory
  *
+ * The window is opened in the running process, so the shell is
+ * spawned without launching kermit again.
+ *
  * \param terminal
  */
 static void termClone(VteTerminal *terminal) {
-    const char prefix[] = "file://";
-    const char *path = vte_terminal_get_current_directory_uri(terminal);
-    if (path && strncmp(prefix, path, strlen(prefix)) == 0) {
-        path += strlen(prefix);
-    }
-    if (fork() == 0) {
-	if (!path) {
-            fprintf(stderr, "Unable to fetch current working directory\n");
-	} else if (chdir(path) == -1) {
-	    perror("Unable to change pwd for new terminal");
-        }
-        if (execvp(args[0], args) == -1) {
-            perror("Cloning the terminal failed");
-            _exit(errno);
-        }
-    }
+    TermWindow *termWindow = getTermWindow(GTK_WIDGET(terminal));
+    gchar *dir = getTermDir(GTK_WIDGET(terminal));
+    newWindow(dir, termWindow->command, termWindow->title);
+    g_free(dir);
 }
 
-/*
- * Handle internal action
- *
- * \param terminal
- * \param action
- * \return FALSE if no action is found & TRUE otherwise
- */
-static gboolean termAction(GtkWidget *terminal, const char *action) {
-    if (strcmp(action, "copy") == 0) {
-        vte_terminal_copy_clipboard_format(VTE_TERMINAL(terminal),
-                                           VTE_FORMAT_TEXT);
-    } else if (strcmp(action, "paste") == 0) {
-        vte_terminal_paste_clipboard(VTE_TERMINAL(terminal));
-    } else if (strcmp(action, "reload-config") == 0) {
-        printLog("Reloading configuration file...\n");
-        if (defaultConfigFile)
-            configFileName = NULL;
-        parseSettings();
-        configureTerm(terminal);
-    } else if (strcmp(action, "default-config") == 0) {
-        printLog("Loading the default configuration...\n");
-        colorCount = 0;
-        configureTerm(terminal);
-    } else if (strcmp(action, "new-tab") == 0) {
-        gtk_notebook_append_page(GTK_NOTEBOOK(notebook), getTerm(), NULL);
-        gtk_widget_show_all(window);
-    } else if (strcmp(action, "new-window") == 0) {
-        termClone(VTE_TERMINAL(terminal));
-    } else if (strcmp(action, "exit") == 0) {
-        gtk_main_quit();
-    } else if (strcmp(action, "inc-font-size") == 0) {
-        setTermFont(terminal, currentFontSize + 1);
-    } else if (strcmp(action, "dec-font-size") == 0) {
-        setTermFont(terminal, currentFontSize - 1);
-    } else if (strcmp(action, "default-font-size") == 0) {
-        setTermFont(terminal, defaultFontSize);
-    } else if (strcmp(action, "next-tab") == 0) {
-        gtk_notebook_next_page(GTK_NOTEBOOK(notebook));
-    } else if (strcmp(action, "prev-tab") == 0) {
-        gtk_notebook_prev_page(GTK_NOTEBOOK(notebook));
-    } else if (strcmp(action, "close-tab") == 0) {
-        if (gtk_notebook_get_n_pages(GTK_NOTEBOOK(notebook)) == 1)
-            return TRUE;
-        closeTab = TRUE;
-        gtk_notebook_remove_page(GTK_NOTEBOOK(notebook),
-                                 gtk_notebook_get_current_page(GTK_NOTEBOOK(notebook)));
-        gtk_widget_queue_draw(GTK_WIDGET(notebook));
-    } else {
-        return FALSE;
-    }
-    return TRUE;
+/*!
+ * Copy to clipboard.
+ *
+ * \param terminal
+ */
+static void actionCopy(GtkWidget *terminal) {
+    vte_terminal_copy_clipboard_format(VTE_TERMINAL(terminal),
+                                       VTE_FORMAT_TEXT);
 }
 
 /*!
- * Handle terminal exit.
+ * Paste from clipboard.
  *
  * \param terminal
- * \param status
- * \param userData
- * \return TRUE on exit
  */
-static gboolean termOnChildExit(VteTerminal *terminal, gint status,
-                                gpointer userData) {
-    /* 'child-exited' signal is emitted on both terminal exit
-     * and (notebook) page deletion. Use closeTab variable
-     * to solve this issue. Also, it closes the current tab on exit.
-     */
-    if (!closeTab) {
-        /* Close the current tab */
-        if (gtk_notebook_get_n_pages(GTK_NOTEBOOK(notebook)) != 1) {
-            gtk_notebook_remove_page(GTK_NOTEBOOK(notebook),
-                                     gtk_notebook_get_current_page(GTK_NOTEBOOK(notebook)));
-            gtk_widget_queue_draw(GTK_WIDGET(notebook));
-            /* Exit the terminal */
-        } else {
-            gtk_main_quit();
-        }
-        /* Close tab */
-    } else {
-        closeTab = FALSE;
-    }
-    return TRUE;
+static void actionPaste(GtkWidget *terminal) {
+    Paste *paste = g_new0(Paste, 1);
+    paste->terminal = terminal;
+    g_object_add_weak_pointer(G_OBJECT(terminal), (gpointer *)&paste->terminal);
+    gtk_clipboard_request_text(gtk_widget_get_clipboard(terminal, GDK_SELECTION_CLIPBOARD),
+                               pasteOnText, paste);
 }
 
 /*!
- * Handle terminal key press events.
+ * Cancel the streaming paste.
  *
  * \param terminal
- * \param event (key press or release)
- * \param userData
- * \return FALSE on normal press & TRUE on custom actions
  */
-static gboolean termOnKeyPress(GtkWidget *terminal, GdkEventKey *event,
-                               gpointer userData) {
-    /* Unused user data */
-    UNUSED(userData);
-    /* Check for CTRL, ALT and SHIFT keys */
-    keyState = event->state & (GDK_CONTROL_MASK | GDK_SHIFT_MASK | GDK_MOD1_MASK);
-    /* CTRL + binding + key */
-    if (keyState == (actionKey | GDK_CONTROL_MASK)) {
-        if (atoi(gdk_keyval_name(event->keyval)) != 0) {
-            gtk_notebook_set_current_page(GTK_NOTEBOOK(notebook),
-                                          atoi(gdk_keyval_name(event->keyval)) - 1);
-            return TRUE;
-        }
-        for (int i = 0; i < defaultKeyCount; i++) {
-            if (!strcasecmp(gdk_keyval_name(event->keyval), defaultKeyBindings[i].bind.key)) {
-                if (!defaultKeyBindings[i].invalid) {
-                    if (defaultKeyBindings[i].bind.internal) {
-                        termAction(terminal, defaultKeyBindings[i].bind.cmd);
-                    } else {
-                        vte_terminal_feed_child(VTE_TERMINAL(terminal),
-                                                defaultKeyBindings[i].bind.cmd, -1);
-                    }
-                    return TRUE;
-                }
-            }
-        }
-        for (int i = 0; i < keyCount; i++) {
-            if (!strcasecmp(gdk_keyval_name(event->keyval), keyBindings[i].key)) {
-                if (keyBindings[i].internal) {
-                    termAction(terminal, keyBindings[i].cmd);
-                } else {
-                    vte_terminal_feed_child(VTE_TERMINAL(terminal),
-                                            keyBindings[i].cmd, -1);
-                }
-                return TRUE;
-            }
-        }
-    }
-    return FALSE;
+static void actionCancelPaste(GtkWidget *terminal) {
+    stopPaste(getTermWindow(terminal));
 }
 
 /*!
- * Set the terminal title on changes.
+ * Reload the configuration file.
  *
  * \param terminal
- * \param userData
- * \return TRUE on title change
  */
-static gboolean termOnTitleChanged(GtkWidget *terminal, gpointer userData) {
-    GtkWindow *window = userData;
-    if (termTitle == NULL)
-        gtk_window_set_title(window,
-                             vte_terminal_get_window_title(VTE_TERMINAL(terminal)) ?: TERM_NAME);
+static void actionReloadConfig(GtkWidget *terminal) {
+    reloadConfig();
+    UNUSED(terminal);
+}
+
+/*!
+ * Load the default configuration.
+ *
+ * \param terminal
+ */
+static void actionDefaultConfig(GtkWidget *terminal) {
+    printLog("Loading the default configuration...\n");
+    colorCount = 0;
+    scheduleConfig(TERM_CHANGE_ALL);
+    UNUSED(terminal);
+}
+
+/*!
+ * Open a new tab.
+ *
+ * \param terminal
+ */
+static void actionNewTab(GtkWidget *terminal) {
+    TermWindow *termWindow = getTermWindow(terminal);
+    appendTab(termWindow, NULL, termWindow->command);
+}
+
+/*!
+ * Open a new tab with the same working directory.
+ *
+ * \param terminal
+ */
+static void actionNewTabHere(GtkWidget *terminal) {
+    TermWindow *termWindow = getTermWindow(terminal);
+    gchar *dir = getTermDir(terminal);
+    appendTab(termWindow, dir, termWindow->command);
+    g_free(dir);
+}
+
+/*!
+ * Open a new window with the same working directory.
+ *
+ * \param terminal
+ */
+static void actionNewWindow(GtkWidget *terminal) {
+    termClone(VTE_TERMINAL(terminal));
+}
+
+/*!
+ * Exit the terminal.
+ *
+ * \param terminal
+ */
+static void actionExit(GtkWidget *terminal) {
+    UNUSED(terminal);
+    gtk_main_quit();
+}
+
+/*!
+ * Increase the font size.
+ *
+ * \param terminal
+ */
+static void actionIncFontSize(GtkWidget *terminal) {
+    setTermFont(terminal, getTermFontSize(terminal) + 1);
+}
+
+/*!
+ * Decrease the font size.
+ *
+ * \param terminal
+ */
+static void actionDecFontSize(GtkWidget *terminal) {
+    setTermFont(terminal, getTermFontSize(terminal) - 1);
+}
+
+/*!
+ * Reset the font size to default.
+ *
+ * \param terminal
+ */
+static void actionDefaultFontSize(GtkWidget *terminal) {
+    setTermFont(terminal, defaultFontSize);
+}
+
+/*!
+ * Switch to the next tab.
+ *
+ * \param terminal
+ */
+static void actionNextTab(GtkWidget *terminal) {
+    gtk_notebook_next_page(GTK_NOTEBOOK(getTermWindow(terminal)->notebook));
+}
+
+/*!
+ * Switch to the previous tab.
+ *
+ * \param terminal
+ */
+static void actionPrevTab(GtkWidget *terminal) {
+    gtk_notebook_prev_page(GTK_NOTEBOOK(getTermWindow(terminal)->notebook));
+}
+
+/*!
+ * Start or stop logging the output of the terminal.
+ *
+ * \param terminal
+ */
+static void actionToggleLog(GtkWidget *terminal) {
+    if (g_object_get_data(G_OBJECT(terminal), TERM_DATA_LOG) != NULL)
+        stopLog(terminal);
     else
-        gtk_window_set_title(window, termTitle);
-    return TRUE;
+        startLog(terminal);
 }
 
 /*!
- * Set the divider position using current window size.
+ * Add or remove the terminal from the broadcast input.
  *
- * \param widget
- * \param allocation
- * \param userData
- * \return TRUE on size change
+ * \param terminal
  */
-static gboolean termOnResize(GtkWidget *widget, GtkAllocation *allocation,
-                             gpointer userData) {
-    if (tabPosition == 1)
-        allocation->height = 0;
-    if (GTK_PANED(userData) != NULL)
-        gtk_paned_set_position(GTK_PANED(userData), allocation->height - 20);
-    return TRUE;
+static void actionToggleBroadcast(GtkWidget *terminal) {
+    TermWindow *termWindow = getTermWindow(terminal);
+    GtkNotebook *notebook = GTK_NOTEBOOK(termWindow->notebook);
+    int current = gtk_notebook_get_current_page(notebook);
+    toggleBroadcast(terminal);
+    /* Update the mark of the tab */
+    termWindow->tabDirty = TRUE;
+    termTabOnSwitch(notebook, gtk_notebook_get_nth_page(notebook, current), current,
+                    termWindow);
 }
 
 /*!
- * Switch to last page when new tab added.
+ * Write the resource report of the terminals.
  *
- * \param notebook
- * \param child
- * \param pageNum
- * \param userData
- * \return TRUE on tab addition
+ * \param terminal
  */
-static gboolean termTabOnAdd(GtkNotebook *notebook, GtkWidget *child,
-                             guint pageNum, gpointer userData) {
-    gtk_notebook_set_current_page(GTK_NOTEBOOK(notebook), pageNum);
-    return TRUE;
+static void actionStats(GtkWidget *terminal) {
+    UNUSED(terminal);
+    GString *report = getReport();
+    writeStatFile("report.json", report);
+    g_string_free(report, TRUE);
 }
 
 /*!
- * The switch event for terminal tabs.
+ * Search in the scrollback of the current tab.
  *
- * \param notebook
- * \param page
- * \param pageNum
- * \param userData
- * \return TRUE on switch
+ * \param terminal
  */
-static gboolean termTabOnSwitch(GtkNotebook *notebook, GtkWidget *page,
-                                guint pageNum, gpointer userData) {
-    /* Destroy tabs label if there's not more than one tabs */
-    if (gtk_notebook_get_n_pages(GTK_NOTEBOOK(notebook)) == 1) {
-        if (tabLabel != NULL)
-            gtk_widget_destroy(tabLabel);
-        return TRUE;
-        /* Add tabs label to paned if it doesn't exist */
-    } else if (gtk_paned_get_child1(GTK_PANED(paned)) == NULL ||
-               gtk_paned_get_child2(GTK_PANED(paned)) == NULL) {
-        tabLabel = gtk_label_new(NULL);
-        gtk_label_set_xalign(GTK_LABEL(tabLabel), 0);
-        if (tabPosition == 0)
-            gtk_paned_add2(GTK_PANED(paned), tabLabel);
-        else
-            gtk_paned_add1(GTK_PANED(paned), tabLabel);
-    }
-    /* Same font as terminal but smaller */
-    gchar *fontStr = g_strconcat(termFont, " ",
-                                 g_strdup_printf("%d", defaultFontSize - 1), NULL);
-    /* Prepare the label text (use different color for current tab) */
-    tabLabelText = g_markup_printf_escaped(
-        "<span font='\%s' foreground='#\%02X\%02X\%02X'>",
-        fontStr,
-        (int)(termPalette[4].red * 255),
-        (int)(termPalette[4].green * 255),
-        (int)(termPalette[4].blue * 255));
-    for (int i = 0; i < gtk_notebook_get_n_pages(GTK_NOTEBOOK(notebook)); i++) {
-        if (i == pageNum)
-            tabLabelText = g_strconcat(tabLabelText,
-                                       g_strdup_printf("<span foreground='#%x'> %d </span>",
-                                                       termForeground, i + 1),
-                                       NULL);
-        else
-            tabLabelText = g_strconcat(tabLabelText,
-                                       g_strdup_printf(" %d ", i + 1), NULL);
-    }
-    tabLabelText = g_strconcat(tabLabelText, "~</span>", NULL);
-    /* Set the label text with markup */
-    gtk_label_set_markup(GTK_LABEL(tabLabel), tabLabelText);
-    g_free(fontStr);
+static void actionSearch(GtkWidget *terminal) {
+    showSearch(getTermWindow(terminal));
+}
+
+/*!
+ * Split the terminal into side by side panes.
+ *
+ * \param terminal
+ */
+static void actionSplitHorizontal(GtkWidget *terminal) {
+    splitTerm(terminal, GTK_ORIENTATION_HORIZONTAL);
+}
+
+/*!
+ * Split the terminal into stacked panes.
+ *
+ * \param terminal
+ */
+static void actionSplitVertical(GtkWidget *terminal) {
+    splitTerm(terminal, GTK_ORIENTATION_VERTICAL);
+}
+
+/*!
+ * Close the current tab.
+ *
+ * \param terminal
+ */
+static void actionCloseTab(GtkWidget *terminal) {
+    GtkWidget *notebook = getTermWindow(terminal)->notebook;
+    if (gtk_notebook_get_n_pages(GTK_NOTEBOOK(notebook)) == 1)
+        return;
+    gtk_notebook_remove_page(GTK_NOTEBOOK(notebook),
+                             gtk_notebook_get_current_page(GTK_NOTEBOOK(notebook)));
+    gtk_widget_queue_draw(GTK_WIDGET(notebook));
+}
+
+static const struct {          /* Internal actions */
+    const char *name;
+    Action action;
+} termActions[] = {
+    { "copy", actionCopy },
+    { "paste", actionPaste },
+    { "reload-config", actionReloadConfig },
+    { "default-config", actionDefaultConfig },
+    { "new-tab", actionNewTab },
+    { "new-tab-here", actionNewTabHere },
+    { "new-window", actionNewWindow },
+    { "exit", actionExit },
+    { "inc-font-size", actionIncFontSize },
+    { "dec-font-size", actionDecFontSize },
+    { "default-font-size", actionDefaultFontSize },
+    { "next-tab", actionNextTab },
+    { "prev-tab", actionPrevTab },
+    { "close-tab", actionCloseTab },
+    { "toggle-log", actionToggleLog },
+    { "search", actionSearch },
+    { "stats", actionStats },
+    { "cancel-paste", actionCancelPaste },
+    { "toggle-broadcast", actionToggleBroadcast },
+    { "split-horizontal", actionSplitHorizontal },
+    { "split-vertical", actionSplitVertical },
+};
+
+/*!
+ * Get the handler of internal action.
+ *
+ * \param name
+ * \return action (NULL if no action is found)
+ */
+static Action getAction(const char *name) {
+    for (int i = 0; i < G_N_ELEMENTS(termActions); i++) {
+        if (strcmp(termActions[i].name, name) == 0)
+            return termActions[i].action;
+    }
+    return NULL;
+}
+
+/*!
+ * Get the notebook page that holds the terminal.
+ *
+ * \param terminal
+ * \param notebook
+ * \return page number (-1 if the terminal is not in the notebook)
+ */
+static int getTermPageNum(GtkWidget *terminal, GtkWidget *notebook) {
+    GtkWidget *page = terminal;
+    while (page != NULL && gtk_widget_get_parent(page) != notebook)
+        page = gtk_widget_get_parent(page);
+    return page != NULL ? gtk_notebook_page_num(GTK_NOTEBOOK(notebook), page) : -1;
+}
+
+/*!
+ * Close the tab or window of the exited terminal.
+ *
+ * \param terminal
+ * \return TRUE on exit
+ */
+static gboolean handleChildExit(VteTerminal *terminal) {
+    /* Close the slave of the throttled terminal */
+    g_object_set_data(G_OBJECT(terminal), TERM_DATA_SLAVE, NULL);
+    /* Drop the warm terminal from the pool */
+    if (g_queue_remove(&warmPool, terminal)) {
+        gtk_widget_destroy(GTK_WIDGET(terminal));
+        g_object_unref(terminal);
+        schedulePoolRefill();
+        return TRUE;
+    }
+    TermWindow *termWindow = getTermWindow(GTK_WIDGET(terminal));
+    /* The window is being destroyed */
+    if (termWindow == NULL)
+        return TRUE;
+    GtkWidget *notebook = termWindow->notebook;
+    /* 'child-exited' signal is emitted on both terminal exit
+     * and (notebook) page deletion. The terminals of a removed
+     * page are not in the notebook anymore.
+     */
+    int page = getTermPageNum(GTK_WIDGET(terminal), notebook);
+    if (page == -1)
+        return TRUE;
+    /* Close the pane of a split tab */
+    if (closePane(GTK_WIDGET(terminal)))
+        return TRUE;
+    /* Close the tab of the terminal, which might be in the background */
+    if (gtk_notebook_get_n_pages(GTK_NOTEBOOK(notebook)) != 1) {
+        gtk_notebook_remove_page(GTK_NOTEBOOK(notebook), page);
+        gtk_widget_queue_draw(GTK_WIDGET(notebook));
+        /* Close the window */
+    } else {
+        gtk_widget_destroy(termWindow->window);
+    }
+    return TRUE;
+}
+
+/*!
+ * Handle terminal exit.
+ *
+ * \param terminal
+ * \param status
+ * \param userData
+ * \return TRUE on exit
+ */
+static gboolean termOnChildExit(VteTerminal *terminal, gint status,
+                                gpointer userData) {
+    UNUSED(status);
+    UNUSED(userData);
+    gint64 start = statStart();
+    gboolean result = handleChildExit(terminal);
+    recordStat(STAT_CHILD_EXIT, start);
+    return result;
+}
+
+/*!
+ * Run the key binding of the key press event.
+ *
+ * \param terminal
+ * \param event (key press or release)
+ * \return FALSE on normal press & TRUE on custom actions
+ */
+static gboolean handleKeyPress(GtkWidget *terminal, GdkEventKey *event) {
+    /* Check for CTRL, ALT and SHIFT keys */
+    keyState = event->state & (GDK_CONTROL_MASK | GDK_SHIFT_MASK | GDK_MOD1_MASK);
+    /* CTRL + binding + key */
+    if (keyState == (actionKey | GDK_CONTROL_MASK)) {
+        if (event->keyval >= GDK_KEY_1 && event->keyval <= GDK_KEY_9) {
+            gtk_notebook_set_current_page(GTK_NOTEBOOK(getTermWindow(terminal)->notebook),
+                                          event->keyval - GDK_KEY_1);
+            return TRUE;
+        }
+        Bindings *binding = g_hash_table_lookup(keyTable,
+            GUINT_TO_POINTER(gdk_keyval_to_lower(event->keyval)));
+        if (binding != NULL) {
+            if (binding->internal) {
+                if (binding->action != NULL)
+                    binding->action(terminal);
+            } else {
+                vte_terminal_feed_child(VTE_TERMINAL(terminal), binding->cmd, -1);
+            }
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/*!
+ * Handle terminal key press events.
+ *
+ * \param terminal
+ * \param event (key press or release)
+ * \param userData
+ * \return FALSE on normal press & TRUE on custom actions
+ */
+static gboolean termOnKeyPress(GtkWidget *terminal, GdkEventKey *event,
+                               gpointer userData) {
+    /* Unused user data */
+    UNUSED(userData);
+    gint64 start = statStart();
+    gboolean result = handleKeyPress(terminal, event);
+    recordStat(STAT_KEY_PRESS, start);
+    return result;
+}
+
+/*!
+ * Set the pending title on the frame clock of the window.
+ *
+ * \param widget
+ * \param frameClock
+ * \param userData (TermWindow)
+ * \return FALSE for removing the callback
+ */
+static gboolean termWindowOnTitleTick(GtkWidget *widget, GdkFrameClock *frameClock,
+                                      gpointer userData) {
+    UNUSED(frameClock);
+    TermWindow *termWindow = userData;
+    termWindow->titleTick = 0;
+    gtk_window_set_title(GTK_WINDOW(widget), termWindow->titlePending);
+    g_free(termWindow->titlePending);
+    termWindow->titlePending = NULL;
+    return G_SOURCE_REMOVE;
+}
+
+/*!
+ * Set the terminal title on changes.
+ *
+ * Title changes are paced to the refresh of the monitor, so an
+ * application updating its title on every line of output only
+ * costs one window title update per frame.
+ *
+ * \param terminal
+ * \param userData
+ * \return TRUE on title change
+ */
+static gboolean termOnTitleChanged(GtkWidget *terminal, gpointer userData) {
+    TermWindow *termWindow = getTermWindow(terminal);
+    if (termWindow == NULL || termWindow->title != NULL)
+        return TRUE;
+    g_free(termWindow->titlePending);
+    termWindow->titlePending =
+        g_strdup(vte_terminal_get_window_title(VTE_TERMINAL(terminal)) ?: TERM_NAME);
+    if (termWindow->titleTick == 0)
+        termWindow->titleTick = gtk_widget_add_tick_callback(termWindow->window,
+                                                             termWindowOnTitleTick,
+                                                             termWindow, NULL);
+    return TRUE;
+}
+
+/*!
+ * Keep track of the last focused window.
+ *
+ * \param widget
+ * \param event
+ * \param userData
+ * \return FALSE for propagating the event
+ */
+static gboolean termWindowOnFocus(GtkWidget *widget, GdkEvent *event,
+                                  gpointer userData) {
+    lastWindow = userData;
+    return FALSE;
+}
+
+/*!
+ * Release the window and exit if it was the last one.
+ *
+ * \param widget
+ * \param userData
+ */
+static void termWindowOnDestroy(GtkWidget *widget, gpointer userData) {
+    TermWindow *termWindow = userData;
+    /* Detach from the widget since the terminals are destroyed afterwards */
+    g_object_set_data(G_OBJECT(widget), TERM_NAME, NULL);
+    g_ptr_array_remove(termWindows, termWindow);
+    if (lastWindow == termWindow)
+        lastWindow = termWindows->len ?
+            g_ptr_array_index(termWindows, termWindows->len - 1) : NULL;
+    if (termWindow->searchSource != 0)
+        g_source_remove(termWindow->searchSource);
+    if (termWindow->settleSource != 0)
+        g_source_remove(termWindow->settleSource);
+    if (termWindow->resizeTick != 0)
+        gtk_widget_remove_tick_callback(widget, termWindow->resizeTick);
+    if (termWindow->titleTick != 0)
+        gtk_widget_remove_tick_callback(widget, termWindow->titleTick);
+    if (termWindow->barsSource != 0)
+        g_source_remove(termWindow->barsSource);
+    cancelSearch(termWindow);
+    stopPaste(termWindow);
+    g_free(termWindow->title);
+    g_free(termWindow->titlePending);
+    g_free(termWindow->command);
+    if (termWindow->tabMarkup != NULL) {
+        g_string_free(termWindow->tabMarkup, TRUE);
+        g_array_free(termWindow->tabOffsets, TRUE);
+    }
+    g_free(termWindow);
+    /* Server keeps running without windows */
+    if (termWindows->len == 0 && !serverMode)
+        gtk_main_quit();
+}
+
+/*!
+ * Set the divider position on the frame after the resize.
+ *
+ * \param widget
+ * \param frameClock
+ * \param userData (TermWindow)
+ * \return FALSE for removing the callback
+ */
+static gboolean termOnResizeTick(GtkWidget *widget, GdkFrameClock *frameClock,
+                                 gpointer userData) {
+    TermWindow *termWindow = userData;
+    UNUSED(widget);
+    UNUSED(frameClock);
+    termWindow->resizeTick = 0;
+    gtk_paned_set_position(GTK_PANED(termWindow->paned),
+                           tabPosition == 1 ? -20 : termWindow->resizeHeight - 20);
+    return G_SOURCE_REMOVE;
+}
+
+/*!
+ * Rewrap the terminals of the window when the main loop is idle.
+ *
+ * \param userData (TermWindow)
+ * \return FALSE for removing the source
+ */
+static gboolean termWindowOnRewrap(gpointer userData) {
+    TermWindow *termWindow = userData;
+    termWindow->settleSource = 0;
+    forEachTerm(termWindow->notebook, releaseRewrap);
+    return G_SOURCE_REMOVE;
+}
+
+/*!
+ * Rewrap the terminals after the resize settles.
+ *
+ * \param userData (TermWindow)
+ * \return FALSE for removing the source
+ */
+static gboolean termWindowOnSettle(gpointer userData) {
+    TermWindow *termWindow = userData;
+    termWindow->settleSource = g_idle_add_full(G_PRIORITY_LOW, termWindowOnRewrap,
+                                               termWindow, NULL);
+    return G_SOURCE_REMOVE;
+}
+
+/*!
+ * Set the divider position using current window size.
+ *
+ * The divider is moved once per frame, and with lazy rewrap the
+ * terminals are rewrapped once after the resize.
+ *
+ * \param widget
+ * \param allocation
+ * \param userData (TermWindow)
+ * \return TRUE on size change
+ */
+static gboolean termOnResize(GtkWidget *widget, GtkAllocation *allocation,
+                             gpointer userData) {
+    TermWindow *termWindow = userData;
+    gboolean resized = termWindow->resizeWidth != 0 &&
+        (allocation->width != termWindow->resizeWidth ||
+         allocation->height != termWindow->resizeHeight);
+    termWindow->resizeWidth = allocation->width;
+    termWindow->resizeHeight = allocation->height;
+    if (termWindow->resizeTick == 0)
+        termWindow->resizeTick = gtk_widget_add_tick_callback(widget, termOnResizeTick,
+                                                              termWindow, NULL);
+    if (!resized || termRewrap != TERM_REWRAP_LAZY)
+        return TRUE;
+    GtkNotebook *notebook = GTK_NOTEBOOK(termWindow->notebook);
+    int current = gtk_notebook_get_current_page(notebook);
+    if (current != -1)
+        forEachTerm(gtk_notebook_get_nth_page(notebook, current), holdRewrap);
+    if (termWindow->settleSource != 0)
+        g_source_remove(termWindow->settleSource);
+    termWindow->settleSource = g_timeout_add(TERM_RESIZE_DELAY, termWindowOnSettle,
+                                             termWindow);
+    return TRUE;
+}
+
+/*!
+ * Write the color of the tab into the tabs label markup.
+ *
+ * \param termWindow
+ * \param tab
+ * \param color
+ */
+static void setTabColor(TermWindow *termWindow, int tab, int color) {
+    char hex[8];
+    snprintf(hex, sizeof(hex), "%06X", color & 0xffffff);
+    memcpy(termWindow->tabMarkup->str + g_array_index(termWindow->tabOffsets, gsize, tab),
+           hex, 6);
+}
+
+/*!
+ * Update the tabs label markup with the active tab.
+ *
+ * Every tab has a segment with the same layout in the markup, so
+ * switching tabs only rewrites the colors of the old and new tab.
+ * The markup is rebuilt when the tab count or configuration changes.
+ *
+ * \param termWindow
+ * \param tabCount
+ * \param active
+ */
+static void updateTabBar(TermWindow *termWindow, int tabCount, int active) {
+    int color = ((int)(theme.palette[4].red * 255) << 16) |
+                ((int)(theme.palette[4].green * 255) << 8) |
+                (int)(theme.palette[4].blue * 255);
+    if (termWindow->tabMarkup == NULL) {
+        termWindow->tabMarkup = g_string_new(NULL);
+        termWindow->tabOffsets = g_array_new(FALSE, FALSE, sizeof(gsize));
+        termWindow->tabDirty = TRUE;
+    }
+    if (!termWindow->tabDirty && termWindow->tabOffsets->len == tabCount) {
+        if (termWindow->tabActive < tabCount)
+            setTabColor(termWindow, termWindow->tabActive, color);
+        setTabColor(termWindow, active, termForeground);
+        termWindow->tabActive = active;
+        return;
+    }
+    /* Same font as terminal but smaller */
+    gchar *header = g_markup_printf_escaped("<span font='%s %d' foreground='#%06X'>",
+                                            termFont, defaultFontSize - 1, color);
+    g_string_assign(termWindow->tabMarkup, header);
+    g_free(header);
+    g_array_set_size(termWindow->tabOffsets, tabCount);
+    for (int i = 0; i < tabCount; i++) {
+        g_string_append(termWindow->tabMarkup, "<span foreground='#");
+        g_array_index(termWindow->tabOffsets, gsize, i) = termWindow->tabMarkup->len;
+        /* Use different color for current tab, mark the broadcast tabs */
+        g_string_append_printf(termWindow->tabMarkup, "%06X'> %d%s </span>",
+                               (i == active ? termForeground : color) & 0xffffff, i + 1,
+                               isBroadcastPage(gtk_notebook_get_nth_page(
+                                   GTK_NOTEBOOK(termWindow->notebook), i)) ? "*" : "");
+    }
+    g_string_append(termWindow->tabMarkup, "~</span>");
+    termWindow->tabActive = active;
+    termWindow->tabDirty = FALSE;
+}
+
+/*!
+ * Switch to last page when new tab added.
+ *
+ * \param notebook
+ * \param child
+ * \param pageNum
+ * \param userData
+ * \return TRUE on tab addition
+ */
+static gboolean termTabOnAdd(GtkNotebook *notebook, GtkWidget *child,
+                             guint pageNum, gpointer userData) {
+    /* Keep the current page and only refresh the tabs label */
+    if (g_object_steal_data(G_OBJECT(child), TERM_DATA_BACKGROUND) != NULL) {
+        TermWindow *termWindow = getTermWindow(GTK_WIDGET(notebook));
+        int current = gtk_notebook_get_current_page(notebook);
+        if (termWindow != NULL && current != -1)
+            termTabOnSwitch(notebook, gtk_notebook_get_nth_page(notebook, current),
+                            current, termWindow);
+        return TRUE;
+    }
+    gtk_notebook_set_current_page(GTK_NOTEBOOK(notebook), pageNum);
+    return TRUE;
+}
+
+/*!
+ * The switch event for terminal tabs.
+ *
+ * \param notebook
+ * \param page
+ * \param pageNum
+ * \param userData
+ * \return TRUE on switch
+ */
+static gboolean termTabOnSwitch(GtkNotebook *notebook, GtkWidget *page,
+                                guint pageNum, gpointer userData) {
+    TermWindow *termWindow = userData;
+    gint64 start = statStart();
+    /* Spawn the shell of a lazy tab on its first switch */
+    if (g_object_get_data(G_OBJECT(page), TERM_DATA_LAZY) != NULL)
+        spawnLazyTab(page);
+    thawPage(page);
+    /* Idle time of the hidden tab starts now */
+    int previous = gtk_notebook_get_current_page(notebook);
+    if (previous != -1 && previous != pageNum)
+        g_object_set_data(G_OBJECT(gtk_notebook_get_nth_page(notebook, previous)),
+                          TERM_DATA_SEEN, GINT_TO_POINTER(getSeconds()));
+    /* Visible tab gets the output at full speed, the hidden one is
+     * stopped by the throttle after a slice with output */
+    if (throttleActive > 0)
+        forEachTerm(page, releaseTerm);
+    /* Destroy tabs label if there's not more than one tabs */
+    if (gtk_notebook_get_n_pages(GTK_NOTEBOOK(notebook)) == 1) {
+        if (termWindow->tabLabel != NULL) {
+            gtk_widget_destroy(termWindow->tabLabel);
+            termWindow->tabLabel = NULL;
+        }
+        recordStat(STAT_TAB_SWITCH, start);
+        return TRUE;
+        /* Add tabs label to paned if it doesn't exist */
+    } else if (termWindow->tabLabel == NULL) {
+        termWindow->tabLabel = gtk_label_new(NULL);
+        gtk_label_set_xalign(GTK_LABEL(termWindow->tabLabel), 0);
+        if (tabPosition == 0)
+            gtk_paned_add2(GTK_PANED(termWindow->paned), termWindow->tabLabel);
+        else
+            gtk_paned_add1(GTK_PANED(termWindow->paned), termWindow->tabLabel);
+        gtk_widget_show(termWindow->tabLabel);
+    }
+    updateTabBar(termWindow, gtk_notebook_get_n_pages(GTK_NOTEBOOK(notebook)), pageNum);
+    /* Set the label text with markup */
+    gtk_label_set_markup(GTK_LABEL(termWindow->tabLabel), termWindow->tabMarkup->str);
+    recordStat(STAT_TAB_SWITCH, start);
+    return TRUE;
+}
+
+/*!
+ * Refresh the tabs label when a tab is removed.
+ *
+ * Removing a background tab doesn't switch the page, and the switch
+ * of a removed current tab is emitted before the tab count changes.
+ *
+ * \param notebook
+ * \param child
+ * \param pageNum
+ * \param userData
+ */
+static void termTabOnRemove(GtkNotebook *notebook, GtkWidget *child,
+                            guint pageNum, gpointer userData) {
+    UNUSED(child);
+    UNUSED(pageNum);
+    UNUSED(userData);
+    TermWindow *termWindow = getTermWindow(GTK_WIDGET(notebook));
+    int current = gtk_notebook_get_current_page(notebook);
+    /* The window is being destroyed */
+    if (termWindow == NULL || current == -1)
+        return;
+    termTabOnSwitch(notebook, gtk_notebook_get_nth_page(notebook, current), current,
+                    termWindow);
+}
+
+/*!
+ * Get the font size of the terminal (including the pending zoom).
+ *
+ * \param terminal
+ * \return font size
+ */
+static int getTermFontSize(GtkWidget *terminal) {
+    int fontSize = GPOINTER_TO_INT(g_object_get_data(G_OBJECT(terminal),
+                                                     TERM_DATA_FONT_SIZE));
+    return fontSize ? fontSize : defaultFontSize;
+}
+
+/*!
+ * Apply the pending zoom of the terminal on the frame clock.
+ *
+ * \param terminal
+ * \param frameClock
+ * \param userData
+ * \return FALSE for removing the callback
+ */
+static gboolean termOnZoomTick(GtkWidget *terminal, GdkFrameClock *frameClock,
+                               gpointer userData) {
+    UNUSED(frameClock);
+    UNUSED(userData);
+    g_object_set_data(G_OBJECT(terminal), TERM_DATA_ZOOM, NULL);
+    vte_terminal_set_font_scale(VTE_TERMINAL(terminal),
+                                (double)getTermFontSize(terminal) / defaultFontSize);
+    return G_SOURCE_REMOVE;
+}
+
+/*!
+ * Set the terminal font with given size.
+ *
+ * The size is applied as a scale of the configured font, and the
+ * repeated calls in the same frame are coalesced into one change.
+ *
+ * \param terminal
+ * \param fontSize
+ * \return 0 on success
+ */
+static int setTermFont(GtkWidget *terminal, int fontSize) {
+    if (fontSize <= 0)
+        return 1;
+    g_object_set_data(G_OBJECT(terminal), TERM_DATA_FONT_SIZE,
+                      GINT_TO_POINTER(fontSize));
+    if (g_object_get_data(G_OBJECT(terminal), TERM_DATA_ZOOM) == NULL) {
+        guint tick = gtk_widget_add_tick_callback(terminal, termOnZoomTick, NULL, NULL);
+        g_object_set_data(G_OBJECT(terminal), TERM_DATA_ZOOM, GUINT_TO_POINTER(tick));
+    }
+    return 0;
+}
+
+/*!
+ * Check if the windows are rendered without the alpha channel.
+ *
+ * \return TRUE for the opaque fast path
+ */
+static gboolean isOpaque() {
+    return termRender == TERM_RENDER_OPAQUE ||
+           (termRender == TERM_RENDER_AUTO && termOpacity >= 1.0);
+}
+
+/*!
+ * Set the visual of the window for the rendering path.
+ *
+ * The RGBA visual is only used for transparency, since the compositor
+ * blends every frame of an RGBA window with the windows below it.
+ * The visual of a realized window is changed by realizing it again.
+ *
+ * \param window
+ */
+static void setWindowVisual(GtkWidget *window) {
+    GdkScreen *screen = gtk_widget_get_screen(window);
+    GdkVisual *visual = isOpaque() ? NULL : gdk_screen_get_rgba_visual(screen);
+    if (visual == NULL)
+        visual = gdk_screen_get_system_visual(screen);
+    if (visual == gtk_widget_get_visual(window))
+        return;
+    printLog("window visual: %s\n", visual == gdk_screen_get_system_visual(screen) ?
+                                        "opaque" : "rgba");
+    if (!gtk_widget_get_realized(window)) {
+        gtk_widget_set_visual(window, visual);
+        return;
+    }
+    gtk_widget_hide(window);
+    gtk_widget_unrealize(window);
+    gtk_widget_set_visual(window, visual);
+    gtk_widget_show(window);
+}
+
+/*!
+ * Resolve the palette, colors and font of the current configuration.
+ *
+ * The result is cached until the configuration generation changes.
+ */
+static void resolveTheme() {
+    if (theme.generation == configGeneration)
+        return;
+    theme.generation = configGeneration;
+    for (int i = colorCount; i < 256; i++) {
+        if (i < 16) {
+            termPalette[i].blue = (((i & 4) ? 0xc000 : 0) + (i > 7 ? 0x3fff : 0)) / 65535.0;
+            termPalette[i].green = (((i & 2) ? 0xc000 : 0) + (i > 7 ? 0x3fff : 0)) / 65535.0;
+            termPalette[i].red = (((i & 1) ? 0xc000 : 0) + (i > 7 ? 0x3fff : 0)) / 65535.0;
+            termPalette[i].alpha = 0;
+        } else if (i < 232) {
+            const unsigned j = i - 16;
+            const unsigned r = j / 36, g = (j / 6) % 6, b = j % 6;
+            termPalette[i].red = ((r == 0) ? 0 : r * 40 + 55) / 255.0;
+            termPalette[i].green = ((g == 0) ? 0 : g * 40 + 55) / 255.0;
+            termPalette[i].blue = ((b == 0) ? 0 : b * 40 + 55) / 255.0;
+            termPalette[i].alpha = 0;
+        } else if (i < 256) {
+            const unsigned shade = 8 + (i - 232) * 10;
+            termPalette[i].red = termPalette[i].green =
+                termPalette[i].blue = (shade | shade << 8) / 65535.0;
+            termPalette[i].alpha = 0;
+        }
+    }
+    memcpy(theme.palette, termPalette, sizeof(theme.palette));
+    theme.foreground = CLR_GDK(termForeground, 0);
+    /* Opaque background skips the alpha blending of every frame */
+    theme.background = CLR_GDK(termBackground, isOpaque() ? 1.0 : termOpacity);
+    theme.bold = CLR_GDK(termBoldColor, 0);
+    theme.cursor = CLR_GDK(termCursorColor, 0);
+    theme.cursorFg = CLR_GDK(termCursorFg, 0);
+    /* Font description with the default size */
+    gchar *fontStr = g_strdup_printf("%s %d", termFont, defaultFontSize);
+    PangoFontDescription *font = pango_font_description_from_string(fontStr);
+    if (font != NULL) {
+        if (theme.font != NULL)
+            pango_font_description_free(theme.font);
+        theme.font = font;
+    }
+    g_free(fontStr);
+}
+
+/*!
+ * Set terminal colors from the resolved theme.
+ *
+ * \param terminal
+ * \return 0 on success
+ */
+static int setTermColors(GtkWidget *terminal) {
+    vte_terminal_set_colors(VTE_TERMINAL(terminal),
+                            &theme.foreground, /* Foreground */
+                            &theme.background, /* Background */
+                            theme.palette,     /* Palette */
+                            TERM_PALETTE_SIZE);
+    vte_terminal_set_color_bold(VTE_TERMINAL(terminal), &theme.bold);
+    return 0;
+}
+
+/*!
+ * Get the scrollback lines that fit into the configured budget.
+ *
+ * \param terminal
+ * \return lines (-1 for unlimited)
+ */
+static long getScrollbackLines(GtkWidget *terminal) {
+    if (termScrollbackBytes <= 0)
+        return termScrollback;
+    /* Approximate the memory of a row with its cells */
+    return termScrollbackBytes /
+           (vte_terminal_get_column_count(VTE_TERMINAL(terminal)) * TERM_CELL_SIZE);
+}
+
+/*!
+ * Fit the scrollback into the budget again when the width changes.
+ *
+ * New terminals get their options before the first allocation, and
+ * the panes of a split or a resized window change their width later.
+ *
+ * \param widget
+ * \param allocation
+ * \param userData
+ */
+static void termOnAllocate(GtkWidget *widget, GtkAllocation *allocation,
+                           gpointer userData) {
+    UNUSED(allocation);
+    UNUSED(userData);
+    if (termScrollbackBytes <= 0)
+        return;
+    glong columns = vte_terminal_get_column_count(VTE_TERMINAL(widget));
+    if (GPOINTER_TO_INT(g_object_get_data(G_OBJECT(widget), TERM_DATA_WIDTH)) == columns)
+        return;
+    g_object_set_data(G_OBJECT(widget), TERM_DATA_WIDTH, GINT_TO_POINTER(columns));
+    vte_terminal_set_scrollback_lines(VTE_TERMINAL(widget), getScrollbackLines(widget));
+}
+
+/*!
+ * Compile the anchored regex of the match pattern.
+ *
+ * \param pattern
+ * \param error
+ * \return TRUE on success
+ */
+static gboolean compileMatchPattern(MatchPattern *pattern, GError **error) {
+    gchar *anchored = g_strdup_printf("^(?:%s)$", pattern->pattern);
+    pattern->regex = g_regex_new(anchored, G_REGEX_OPTIMIZE, 0, error);
+    g_free(anchored);
+    return pattern->regex != NULL;
+}
+
+/*!
+ * Free the pattern of the match option.
+ *
+ * \param data (MatchPattern)
+ */
+static void freeMatchPattern(gpointer data) {
+    MatchPattern *pattern = data;
+    g_free(pattern->pattern);
+    g_free(pattern->command);
+    g_regex_unref(pattern->regex);
+    g_free(pattern);
+}
+
+/*!
+ * Get the patterns of the match options.
+ *
+ * \param count (set to the pattern count)
+ * \return patterns
+ */
+static MatchPattern **getMatchPatterns(guint *count) {
+    static MatchPattern *defaultPatterns[] = { &urlPattern };
+    if (matchPatterns == NULL || matchPatterns->len == 0) {
+        if (urlPattern.regex == NULL)
+            compileMatchPattern(&urlPattern, NULL);
+        *count = G_N_ELEMENTS(defaultPatterns);
+        return defaultPatterns;
+    }
+    *count = matchPatterns->len;
+    return (MatchPattern **)matchPatterns->pdata;
+}
+
+/*!
+ * Get the regex of the match patterns for the current configuration.
+ *
+ * All patterns are compiled once into a single JIT compiled regex,
+ * which is shared by the terminals, so VTE scans the hovered row for
+ * all of them in one pass. The regex is only compiled again if the
+ * patterns are changed.
+ *
+ * \return regex (NULL if it is not compiled)
+ */
+static VteRegex *getMatchRegex() {
+    if (matchRegex.generation == configGeneration)
+        return matchRegex.regex;
+    matchRegex.generation = configGeneration;
+    guint count;
+    MatchPattern **patterns = getMatchPatterns(&count);
+    GString *source = g_string_new(NULL);
+    for (guint i = 0; i < count; i++)
+        g_string_append_printf(source, "%s(?:%s)", i > 0 ? "|" : "", patterns[i]->pattern);
+    if (matchRegex.source != NULL && g_string_equal(source, matchRegex.source)) {
+        g_string_free(source, TRUE);
+        return matchRegex.regex;
+    }
+    if (matchRegex.source != NULL)
+        g_string_free(matchRegex.source, TRUE);
+    if (matchRegex.regex != NULL)
+        vte_regex_unref(matchRegex.regex);
+    matchRegex.source = source;
+    GError *error = NULL;
+    matchRegex.regex = vte_regex_new_for_match(source->str, source->len,
+                                               PCRE2_UTF | PCRE2_NO_UTF_CHECK |
+                                               PCRE2_UCP | PCRE2_MULTILINE, &error);
+    if (matchRegex.regex == NULL) {
+        fprintf(stderr, "Invalid match patterns: %s\n", error->message);
+        g_clear_error(&error);
+        return NULL;
+    }
+    if (!vte_regex_jit(matchRegex.regex, PCRE2_JIT_COMPLETE, &error)) {
+        printLog("match regex is not JIT compiled: %s\n", error->message);
+        g_clear_error(&error);
+    }
+    printLog("match patterns: %u\n", count);
+    return matchRegex.regex;
+}
+
+/*!
+ * Set the match regex of the terminal.
+ *
+ * \param terminal
+ */
+static void setTermMatch(GtkWidget *terminal) {
+    VteRegex *regex = getMatchRegex();
+    /* Referenced by the terminal, so an unchanged regex is kept */
+    if (g_object_get_data(G_OBJECT(terminal), TERM_DATA_MATCH) == regex)
+        return;
+    vte_terminal_match_remove_all(VTE_TERMINAL(terminal));
+    g_object_set_data(G_OBJECT(terminal), TERM_DATA_MATCH, NULL);
+    if (regex == NULL)
+        return;
+    int tag = vte_terminal_match_add_regex(VTE_TERMINAL(terminal), regex, 0);
+    vte_terminal_match_set_cursor_name(VTE_TERMINAL(terminal), tag, "pointer");
+    g_object_set_data_full(G_OBJECT(terminal), TERM_DATA_MATCH, vte_regex_ref(regex),
+                           (GDestroyNotify)vte_regex_unref);
+}
+
+/*!
+ * Open the text with the command in the directory of the terminal.
+ *
+ * \param terminal
+ * \param command
+ * \param text (appended to the command as an argument)
+ */
+static void openMatch(GtkWidget *terminal, const char *command, const char *text) {
+    gchar **argv;
+    GError *error = NULL;
+    if (!g_shell_parse_argv(command, NULL, &argv, &error)) {
+        fprintf(stderr, "Invalid match command '%s': %s\n", command, error->message);
+        g_clear_error(&error);
+        return;
+    }
+    guint argc = g_strv_length(argv);
+    argv = g_renew(gchar *, argv, argc + 2);
+    argv[argc] = g_strdup(text);
+    argv[argc + 1] = NULL;
+    gchar *dir = getTermDir(terminal);
+    printLog("open: %s %s\n", command, text);
+    if (!g_spawn_async(dir, argv, NULL, G_SPAWN_SEARCH_PATH, NULL, NULL, NULL, &error)) {
+        fprintf(stderr, "Failed to open '%s': %s\n", text, error->message);
+        g_clear_error(&error);
+    }
+    g_free(dir);
+    g_strfreev(argv);
+}
+
+/*!
+ * Open the hyperlink or the matched text on Ctrl+click.
+ *
+ * The pattern of the text is only looked up on the click,
+ * hovering only runs the shared regex.
+ *
+ * \param widget
+ * \param event
+ * \param userData
+ * \return TRUE if the click is handled
+ */
+static gboolean termOnButtonPress(GtkWidget *widget, GdkEventButton *event,
+                                  gpointer userData) {
+    UNUSED(userData);
+    if (event->type != GDK_BUTTON_PRESS || event->button != 1 ||
+        !(event->state & GDK_CONTROL_MASK))
+        return FALSE;
+    VteTerminal *terminal = VTE_TERMINAL(widget);
+    /* Explicit hyperlinks (OSC 8) come first */
+    char *text = vte_terminal_hyperlink_check_event(terminal, (GdkEvent *)event);
+    if (text != NULL) {
+        openMatch(widget, TERM_MATCH_COMMAND, text);
+        g_free(text);
+        return TRUE;
+    }
+    int tag;
+    text = vte_terminal_match_check_event(terminal, (GdkEvent *)event, &tag);
+    if (text == NULL)
+        return FALSE;
+    guint count;
+    MatchPattern **patterns = getMatchPatterns(&count);
+    for (guint i = 0; i < count; i++) {
+        if (g_regex_match(patterns[i]->regex, text, 0, NULL)) {
+            openMatch(widget, patterns[i]->command, text);
+            break;
+        }
+    }
+    g_free(text);
+    return TRUE;
+}
+
+/*!
+ * Set the terminal options that don't change the theme.
+ *
+ * \param terminal
+ */
+static void setTermOptions(GtkWidget *terminal) {
+    /* Set numeric locale */
+    setlocale(LC_NUMERIC, termLocale);
+    vte_terminal_set_scrollback_lines(VTE_TERMINAL(terminal),
+                                      getScrollbackLines(terminal));
+    /* Set char exceptions */
+    vte_terminal_set_word_char_exceptions(VTE_TERMINAL(terminal),
+                                          termWordChars);
+    vte_terminal_set_cursor_shape(VTE_TERMINAL(terminal), termCursorShape);
+    /* Rewrap the content when terminal size changed (unless it is held) */
+    vte_terminal_set_rewrap_on_resize(VTE_TERMINAL(terminal),
+        termRewrap != TERM_REWRAP_OFF &&
+        g_object_get_data(G_OBJECT(terminal), TERM_DATA_COLUMNS) == NULL);
+    setTermMatch(terminal);
+}
+
+/*!
+ * Configure the terminal.
+ *
+ * \param terminal
+ * \return 0 on success
+ */
+static int configureTerm(GtkWidget *terminal) {
+    gint64 start = statStart();
+    /* Use the cached theme of the current configuration */
+    resolveTheme();
+    setTermOptions(terminal);
+    /* Hide the mouse cursor when typing */
+    vte_terminal_set_mouse_autohide(VTE_TERMINAL(terminal), TRUE);
+    /* Scroll issues */
+    vte_terminal_set_scroll_on_output(VTE_TERMINAL(terminal), FALSE);
+    vte_terminal_set_scroll_on_keystroke(VTE_TERMINAL(terminal), TRUE);
+    /* Disable audible bell */
+    vte_terminal_set_audible_bell(VTE_TERMINAL(terminal), FALSE);
+    /* Enable bold text */
+    vte_terminal_set_allow_bold(VTE_TERMINAL(terminal), TRUE);
+    /* Allow hyperlinks */
+    vte_terminal_set_allow_hyperlink(VTE_TERMINAL(terminal), TRUE);
+    /* Zuckerberg feature */
+    vte_terminal_set_cursor_blink_mode(VTE_TERMINAL(terminal),
+                                       VTE_CURSOR_BLINK_OFF);
+    /* Set cursor options */
+    vte_terminal_set_color_cursor(VTE_TERMINAL(terminal), &theme.cursor);
+    vte_terminal_set_color_cursor_foreground(VTE_TERMINAL(terminal), &theme.cursorFg);
+    /* Set the terminal colors and font */
+    setTermColors(terminal);
+    if (theme.font != NULL)
+        vte_terminal_set_font(VTE_TERMINAL(terminal), theme.font);
+    g_object_set_data(G_OBJECT(terminal), TERM_DATA_FONT_SIZE, NULL);
+    vte_terminal_set_font_scale(VTE_TERMINAL(terminal), 1.0);
+    g_object_set_data(G_OBJECT(terminal), TERM_DATA_GENERATION,
+                      GUINT_TO_POINTER(configGeneration));
+    recordStat(STAT_CONFIGURE, start);
+    return 0;
+}
+
+/*!
+ * Configure the terminal (callback for the terminal iteration).
+ *
+ * \param terminal
+ */
+static void reconfigureTerm(GtkWidget *terminal) {
+    configureTerm(terminal);
+}
+
+/*!
+ * Update the options of the terminal (callback for the terminal iteration).
+ *
+ * \param terminal
+ */
+static void updateTermOptions(GtkWidget *terminal) {
+    setTermOptions(terminal);
+    g_object_set_data(G_OBJECT(terminal), TERM_DATA_GENERATION,
+                      GUINT_TO_POINTER(configGeneration));
+}
+
+/*!
+ * Call the function for all terminals in the widget tree.
+ *
+ * \param widget
+ * \param func (Action)
+ */
+static void forEachTerm(GtkWidget *widget, gpointer func) {
+    if (VTE_IS_TERMINAL(widget))
+        ((Action)func)(widget);
+    else if (GTK_IS_CONTAINER(widget))
+        gtk_container_foreach(GTK_CONTAINER(widget), (GtkCallback)forEachTerm, func);
+}
+
+/*!
+ * Close the file descriptor that is stored as object data.
+ *
+ * \param data (file descriptor + 1)
+ */
+static void closeFd(gpointer data) {
+    close(GPOINTER_TO_INT(data) - 1);
+}
+
+/*!
+ * Get the slave side of the terminal's PTY for the flow control.
+ *
+ * The slave is opened once and kept while the terminal is throttled.
+ * It is closed when the tab is shown or the child exits, since the
+ * master doesn't get EOF while it is open.
+ *
+ * \param terminal
+ * \return file descriptor (-1 if the terminal is not spawned)
+ */
+static int getTermSlave(GtkWidget *terminal) {
+    int fd = GPOINTER_TO_INT(g_object_get_data(G_OBJECT(terminal), TERM_DATA_SLAVE)) - 1;
+    VtePty *pty = vte_terminal_get_pty(VTE_TERMINAL(terminal));
+    if (fd != -1 || pty == NULL)
+        return fd;
+    char name[TERM_CONFIG_LENGTH];
+    if (ptsname_r(vte_pty_get_fd(pty), name, sizeof(name)) != 0 ||
+        (fd = open(name, O_RDWR | O_NOCTTY | O_CLOEXEC)) == -1)
+        return -1;
+    g_object_set_data_full(G_OBJECT(terminal), TERM_DATA_SLAVE, GINT_TO_POINTER(fd + 1),
+                           closeFd);
+    return fd;
+}
+
+/*!
+ * Set the output flow of the terminal's child.
+ *
+ * Output is stopped on the slave side of the PTY, so the child
+ * blocks on write and nothing is read or processed by VTE.
+ *
+ * \param terminal
+ * \param suspend
+ */
+static void setTermFlow(GtkWidget *terminal, gboolean suspend) {
+    if (GPOINTER_TO_INT(g_object_get_data(G_OBJECT(terminal), TERM_DATA_SUSPENDED)) ==
+        suspend)
+        return;
+    int fd = getTermSlave(terminal);
+    /* Not spawned yet */
+    if (fd == -1)
+        return;
+    if (tcflow(fd, suspend ? TCOOFF : TCOON) == 0)
+        g_object_set_data(G_OBJECT(terminal), TERM_DATA_SUSPENDED, GINT_TO_POINTER(suspend));
+}
+
+/*!
+ * Restart the output of the shown terminal and close its slave.
+ *
+ * \param terminal
+ */
+static void releaseTerm(GtkWidget *terminal) {
+    setTermFlow(terminal, FALSE);
+    g_object_set_data(G_OBJECT(terminal), TERM_DATA_SLAVE, NULL);
+}
+
+/*!
+ * Restart the output of the stopped terminal for a time slice.
+ *
+ * \param terminal
+ */
+static void wakeTerm(GtkWidget *terminal) {
+    g_object_set_data(G_OBJECT(terminal), TERM_DATA_OUTPUT, NULL);
+    setTermFlow(terminal, FALSE);
+    throttleWoken++;
+}
+
+/*!
+ * Stop the output of the terminal if it was busy in the time slice.
+ *
+ * Idle terminals are left running, so they don't cost system calls
+ * on every tick. They are stopped after the slice they get busy in.
+ *
+ * \param terminal
+ */
+static void sliceTerm(GtkWidget *terminal) {
+    if (g_object_steal_data(G_OBJECT(terminal), TERM_DATA_OUTPUT) != NULL)
+        setTermFlow(terminal, TRUE);
+}
+
+/*!
+ * Call the function for the terminals in the hidden tabs of all windows.
+ *
+ * \param func (Action)
+ */
+static void forEachHiddenTerm(gpointer func) {
+    for (int i = 0; i < termWindows->len; i++) {
+        GtkNotebook *notebook =
+            GTK_NOTEBOOK(((TermWindow *)g_ptr_array_index(termWindows, i))->notebook);
+        int current = gtk_notebook_get_current_page(notebook);
+        for (int j = 0; j < gtk_notebook_get_n_pages(notebook); j++) {
+            if (j != current)
+                forEachTerm(gtk_notebook_get_nth_page(notebook, j), func);
+        }
+    }
+}
+
+/*!
+ * Stop the hidden tabs at the end of their time slice.
+ *
+ * \param userData
+ * \return FALSE for removing the source
+ */
+static gboolean throttleOnSlice(gpointer userData) {
+    UNUSED(userData);
+    forEachHiddenTerm(sliceTerm);
+    return G_SOURCE_REMOVE;
+}
+
+/*!
+ * Let the hidden tabs read their output for a time slice.
+ *
+ * \param userData
+ * \return TRUE for keeping the source
+ */
+static gboolean throttleOnTick(gpointer userData) {
+    UNUSED(userData);
+    throttleWoken = 0;
+    forEachHiddenTerm(wakeTerm);
+    if (throttleWoken > 0)
+        g_timeout_add(TERM_THROTTLE_SLICE, throttleOnSlice, NULL);
+    return G_SOURCE_CONTINUE;
+}
+
+/*!
+ * Start, restart or stop the throttling of the hidden tabs.
+ */
+static void updateThrottle() {
+    if (throttleActive == throttleInterval)
+        return;
+    if (throttleSource != 0) {
+        g_source_remove(throttleSource);
+        throttleSource = 0;
+        forEachHiddenTerm(releaseTerm);
+    }
+    throttleActive = throttleInterval;
+    if (throttleActive > 0)
+        throttleSource = g_timeout_add(throttleActive, throttleOnTick, NULL);
+    printLog("throttle: %d ms\n", throttleActive);
+}
+
+/*!
+ * Get the time of the main loop in seconds.
+ *
+ * \return seconds
+ */
+static int getSeconds() {
+    return g_get_monotonic_time() / G_USEC_PER_SEC;
+}
+
+/*!
+ * Hibernate the tab: its terminals are unrealized, which drops their
+ * windows, render surfaces and font caches. The output of the children
+ * is not stopped, so background jobs keep running, and VTE still reads
+ * it into the scrollback without drawing.
+ * The tab is realized again when it is mapped on the next switch.
+ *
+ * \param page
+ */
+static void hibernatePage(GtkWidget *page) {
+    if (g_object_get_data(G_OBJECT(page), TERM_DATA_LAZY) != NULL ||
+        getPageTerm(page) == NULL || !gtk_widget_get_realized(page))
+        return;
+    gtk_widget_unrealize(page);
+    g_object_set_data(G_OBJECT(page), TERM_DATA_HIBERNATED, GINT_TO_POINTER(TRUE));
+    printLog("tab hibernated\n");
+}
+
+/*!
+ * Mark the hibernated tab as awake.
+ *
+ * \param page
+ */
+static void thawPage(GtkWidget *page) {
+    if (g_object_steal_data(G_OBJECT(page), TERM_DATA_HIBERNATED) == NULL)
+        return;
+    printLog("tab thawed\n");
+}
+
+/*!
+ * Hibernate the hidden tabs that are not seen for the idle time.
+ *
+ * \param userData
+ * \return TRUE for keeping the source
+ */
+static gboolean hibernateOnTick(gpointer userData) {
+    UNUSED(userData);
+    int now = getSeconds();
+    for (int i = 0; i < termWindows->len; i++) {
+        GtkNotebook *notebook =
+            GTK_NOTEBOOK(((TermWindow *)g_ptr_array_index(termWindows, i))->notebook);
+        int current = gtk_notebook_get_current_page(notebook);
+        for (int j = 0; j < gtk_notebook_get_n_pages(notebook); j++) {
+            GtkWidget *page = gtk_notebook_get_nth_page(notebook, j);
+            int seen = GPOINTER_TO_INT(g_object_get_data(G_OBJECT(page), TERM_DATA_SEEN));
+            if (j == current)
+                continue;
+            /* Tabs that were never hidden start their idle time now */
+            if (seen == 0)
+                g_object_set_data(G_OBJECT(page), TERM_DATA_SEEN, GINT_TO_POINTER(now));
+            else if (now - seen >= hibernateInterval)
+                hibernatePage(page);
+        }
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+/*!
+ * Start or stop the hibernation timer for the configured idle time.
+ */
+static void updateHibernate() {
+    if (hibernateActive == hibernateInterval)
+        return;
+    if (hibernateSource != 0) {
+        g_source_remove(hibernateSource);
+        hibernateSource = 0;
+    }
+    hibernateActive = hibernateInterval;
+    if (hibernateActive > 0)
+        hibernateSource = g_timeout_add_seconds(MIN(hibernateActive, TERM_HIBERNATE_CHECK),
+                                                hibernateOnTick, NULL);
+    printLog("hibernate: %d s\n", hibernateActive);
+}
+
+/*!
+ * Apply the configuration to all terminals of all windows.
+ *
+ * \param userData
+ * \return FALSE for removing the source
+ */
+static gboolean applyConfig(gpointer userData) {
+    UNUSED(userData);
+    guint changes = applyChanges;
+    applySource = 0;
+    applyChanges = 0;
+    /* Resolved once and shared with every terminal */
+    resolveTheme();
+    for (int i = 0; i < termWindows->len; i++) {
+        TermWindow *termWindow = g_ptr_array_index(termWindows, i);
+        /* Theme is unchanged, skip the relayout */
+        if (!(changes & TERM_CHANGE_THEME)) {
+            forEachTerm(termWindow->notebook, updateTermOptions);
+            continue;
+        }
+        setWindowVisual(termWindow->window);
+        gtk_widget_override_background_color(termWindow->window, GTK_STATE_FLAG_NORMAL,
+                                             &theme.background);
+        forEachTerm(termWindow->notebook, reconfigureTerm);
+        /* Refresh the tabs label with the new font and colors */
+        termWindow->tabDirty = TRUE;
+        if (termWindow->tabLabel != NULL) {
+            GtkNotebook *notebook = GTK_NOTEBOOK(termWindow->notebook);
+            updateTabBar(termWindow, gtk_notebook_get_n_pages(notebook),
+                         gtk_notebook_get_current_page(notebook));
+            gtk_label_set_markup(GTK_LABEL(termWindow->tabLabel),
+                                 termWindow->tabMarkup->str);
+        }
+    }
+    updateThrottle();
+    updateHibernate();
+    printLog("config generation %u applied\n", configGeneration);
+    return G_SOURCE_REMOVE;
+}
+
+/*!
+ * Start a new configuration generation and apply it on idle.
+ *
+ * Changes requested in the same main loop iteration are coalesced,
+ * so all terminals are reconfigured in a single pass and relayout.
+ *
+ * \param changes (TERM_CHANGE_*)
+ */
+static void scheduleConfig(guint changes) {
+    configGeneration++;
+    applyChanges |= changes;
+    if (applySource == 0)
+        applySource = g_idle_add(applyConfig, NULL);
+}
+
+typedef struct {               /* Parsed settings that are applied to the terminals */
+    GdkRGBA palette[TERM_PALETTE_SIZE];
+    int colorCount;
+    int colors[5];
+    int fontSize;
+    float opacity;
+    int render;
+    char *font;
+    long scrollback[2];
+    int cursorShape;
+    int rewrap;
+    char *wordChars;
+    char *locale;
+    GPtrArray *matches;
+} Settings;
+
+/*!
+ * Save the current settings for comparing after a reload.
+ *
+ * \param settings
+ */
+static void saveSettings(Settings *settings) {
+    memcpy(settings->palette, termPalette, sizeof(termPalette));
+    settings->colorCount = colorCount;
+    settings->colors[0] = termForeground;
+    settings->colors[1] = termBackground;
+    settings->colors[2] = termBoldColor;
+    settings->colors[3] = termCursorColor;
+    settings->colors[4] = termCursorFg;
+    settings->fontSize = defaultFontSize;
+    settings->opacity = termOpacity;
+    settings->render = termRender;
+    settings->font = g_strdup(termFont);
+    settings->scrollback[0] = termScrollback;
+    settings->scrollback[1] = termScrollbackBytes;
+    settings->cursorShape = termCursorShape;
+    settings->rewrap = termRewrap;
+    settings->wordChars = g_strdup(termWordChars);
+    settings->locale = g_strdup(termLocale);
+    /* Kept alive until compared */
+    settings->matches = matchPatterns != NULL ? g_ptr_array_ref(matchPatterns) : NULL;
+}
+
+/*!
+ * Compare the patterns of two match option sets.
+ *
+ * \param old
+ * \param new
+ * \return TRUE if the patterns or commands differ
+ */
+static gboolean diffMatches(GPtrArray *old, GPtrArray *new) {
+    guint oldCount = old != NULL ? old->len : 0, newCount = new != NULL ? new->len : 0;
+    if (oldCount != newCount)
+        return TRUE;
+    for (guint i = 0; i < newCount; i++) {
+        MatchPattern *a = g_ptr_array_index(old, i), *b = g_ptr_array_index(new, i);
+        if (strcmp(a->pattern, b->pattern) || strcmp(a->command, b->command))
+            return TRUE;
+    }
+    return FALSE;
+}
+
+/*!
+ * Compare the saved settings with the current ones.
+ *
+ * \param settings (freed)
+ * \return changes (TERM_CHANGE_*)
+ */
+static guint diffSettings(Settings *settings) {
+    guint changes = 0;
+    if (settings->colorCount != colorCount ||
+        memcmp(settings->palette, termPalette, colorCount * sizeof(GdkRGBA)) ||
+        settings->colors[0] != termForeground || settings->colors[1] != termBackground ||
+        settings->colors[2] != termBoldColor || settings->colors[3] != termCursorColor ||
+        settings->colors[4] != termCursorFg || settings->fontSize != defaultFontSize ||
+        settings->opacity != termOpacity || settings->render != termRender ||
+        g_strcmp0(settings->font, termFont))
+        changes |= TERM_CHANGE_THEME;
+    if (settings->scrollback[0] != termScrollback ||
+        settings->scrollback[1] != termScrollbackBytes ||
+        settings->cursorShape != termCursorShape || settings->rewrap != termRewrap ||
+        g_strcmp0(settings->wordChars, termWordChars) ||
+        g_strcmp0(settings->locale, termLocale) ||
+        diffMatches(settings->matches, matchPatterns))
+        changes |= TERM_CHANGE_OPTIONS;
+    if (settings->matches != NULL)
+        g_ptr_array_unref(settings->matches);
+    g_free(settings->font);
+    g_free(settings->wordChars);
+    g_free(settings->locale);
+    return changes;
+}
+
+/*!
+ * Reload the configuration file and apply the changed settings.
+ *
+ * Terminals are only touched if their settings are changed, and
+ * they are not relayout unless the theme is changed.
+ */
+static void reloadConfig() {
+    Settings settings;
+    printLog("Reloading configuration file...\n");
+    saveSettings(&settings);
+    if (defaultConfigFile)
+        configFileName = NULL;
+    parseSettings();
+    guint changes = diffSettings(&settings);
+    printLog("config changes: %s%s\n",
+             changes & TERM_CHANGE_THEME ? "theme " : "",
+             changes & TERM_CHANGE_OPTIONS ? "options" : "");
+    if (changes != 0)
+        scheduleConfig(changes);
+    schedulePoolRefill();
+    updateThrottle();
+    updateHibernate();
+}
+
+/*!
+ * Reload the configuration after the burst of file changes.
+ *
+ * \param userData
+ * \return FALSE for removing the source
+ */
+static gboolean configOnReload(gpointer userData) {
+    UNUSED(userData);
+    reloadSource = 0;
+    reloadConfig();
+    return G_SOURCE_REMOVE;
+}
+
+/*!
+ * Debounce the changes of the configuration file.
+ *
+ * \param monitor
+ * \param file
+ * \param otherFile
+ * \param event
+ * \param userData
+ */
+static void configOnChanged(GFileMonitor *monitor, GFile *file, GFile *otherFile,
+                            GFileMonitorEvent event, gpointer userData) {
+    UNUSED(monitor);
+    UNUSED(file);
+    UNUSED(otherFile);
+    UNUSED(userData);
+    if (event != G_FILE_MONITOR_EVENT_CHANGED &&
+        event != G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT &&
+        event != G_FILE_MONITOR_EVENT_CREATED &&
+        event != G_FILE_MONITOR_EVENT_MOVED_IN &&
+        event != G_FILE_MONITOR_EVENT_RENAMED)
+        return;
+    /* Editors write the file many times in a row */
+    if (reloadSource != 0)
+        g_source_remove(reloadSource);
+    reloadSource = g_timeout_add(TERM_RELOAD_DELAY, configOnReload, NULL);
+}
+
+/*!
+ * Watch the configuration file for changes.
+ */
+static void watchConfig() {
+    if (!autoReload || configPath == NULL || configMonitor != NULL)
+        return;
+    GError *error = NULL;
+    GFile *file = g_file_new_for_path(configPath);
+    configMonitor = g_file_monitor_file(file, G_FILE_MONITOR_NONE, NULL, &error);
+    g_object_unref(file);
+    if (configMonitor == NULL) {
+        printLog("An error occurred: %s\n", error->message);
+        g_clear_error(&error);
+        return;
+    }
+    g_signal_connect(configMonitor, "changed", G_CALLBACK(configOnChanged), NULL);
+    printLog("watching: %s\n", configPath);
+}
+
+/*!
+ * Record the end of a startup phase for the startup trace.
+ *
+ * Only the first end of each phase is recorded.
+ *
+ * \param phase
+ */
+static void markStartup(const char *phase) {
+    if (startupMarks == NULL)
+        return;
+    for (int i = 0; i < startupMarks->len; i++)
+        if (!strcmp(g_array_index(startupMarks, StartupMark, i).phase, phase))
+            return;
+    StartupMark mark = { .phase = phase, .time = g_get_monotonic_time() };
+    g_array_append_val(startupMarks, mark);
+}
+
+/*!
+ * Print the startup trace and stop recording.
+ */
+static void printStartup() {
+    StartupMark *first = &g_array_index(startupMarks, StartupMark, 0);
+    fprintf(stderr, "%-10s %10s %10s\n", "phase", "total ms", "phase ms");
+    for (int i = 1; i < startupMarks->len; i++) {
+        StartupMark *mark = &g_array_index(startupMarks, StartupMark, i);
+        fprintf(stderr, "%-10s %10.2f %10.2f\n", mark->phase,
+                (mark->time - first->time) / 1000.0, (mark->time - (mark - 1)->time) / 1000.0);
+    }
+    g_array_free(startupMarks, TRUE);
+    startupMarks = NULL;
+}
+
+/*!
+ * Record the first frame of the window.
+ *
+ * \param widget
+ * \param cr
+ * \param userData
+ * \return FALSE for propagating the event
+ */
+static gboolean startupOnDraw(GtkWidget *widget, cairo_t *cr, gpointer userData) {
+    UNUSED(cr);
+    markStartup("draw");
+    g_signal_handlers_disconnect_by_func(widget, startupOnDraw, userData);
+    return FALSE;
+}
+
+/*!
+ * Finish the startup trace on the first output of a shell.
+ *
+ * \param terminal
+ * \param userData
+ */
+static void startupOnOutput(VteTerminal *terminal, gpointer userData) {
+    g_signal_handlers_disconnect_by_func(terminal, startupOnOutput, userData);
+    if (startupMarks == NULL)
+        return;
+    markStartup("output");
+    printStartup();
+}
+
+/*!
+ * Async callback for terminal state.
+ *
+ * \param terminal
+ * \param pid (Process ID)
+ * \param error
+ * \param userData
+ */
+static void termStateCallback(VteTerminal *terminal, GPid pid,
+                              GError *error, gpointer userData) {
+    gint64 *spawnTime = g_object_get_data(G_OBJECT(terminal), TERM_DATA_SPAWN_TIME);
+    if (spawnTime != NULL)
+        recordStat(STAT_SPAWN, *spawnTime);
+    if (error == NULL) {
+        g_object_set_data(G_OBJECT(terminal), TERM_DATA_PID, GINT_TO_POINTER(pid));
+        printLog("%s started. (PID: %d)\n", TERM_NAME, pid);
+        markStartup("child");
+    } else {
+        printLog("An error occurred: %s\n", error->message);
+        g_clear_error(&error);
+    }
+    UNUSED(userData);
+}
+
+/*!
+ * Record the time from spawn to the first output of the terminal.
+ *
+ * \param terminal
+ * \param userData
+ */
+static void termOnFirstOutput(VteTerminal *terminal, gpointer userData) {
+    UNUSED(userData);
+    gint64 *spawnTime = g_object_get_data(G_OBJECT(terminal), TERM_DATA_SPAWN_TIME);
+    if (spawnTime != NULL)
+        recordStat(STAT_FIRST_OUTPUT, *spawnTime);
+    g_signal_handlers_disconnect_by_func(terminal, termOnFirstOutput, userData);
+}
+
+/*!
+ * Open the log file in the writer thread.
+ *
+ * \param log
+ */
+static void openLog(TermLog *log) {
+    GError *error = NULL;
+    gchar *dir = g_path_get_dirname(log->path);
+    g_mkdir_with_parents(dir, 0700);
+    g_free(dir);
+    GFile *file = g_file_new_for_path(log->path);
+    GFileOutputStream *output = g_file_append_to(file, G_FILE_CREATE_PRIVATE, NULL, &error);
+    g_object_unref(file);
+    if (output == NULL) {
+        fprintf(stderr, "Unable to open the log: %s\n", error->message);
+        g_clear_error(&error);
+        return;
+    }
+    /* Large writes instead of one per line */
+    log->stream = g_buffered_output_stream_new_sized(G_OUTPUT_STREAM(output),
+                                                     TERM_LOG_BUFFER);
+    g_object_unref(output);
+    if (log->compress) {
+        GZlibCompressor *compressor =
+            g_zlib_compressor_new(G_ZLIB_COMPRESSOR_FORMAT_GZIP, -1);
+        GOutputStream *buffered = log->stream;
+        log->stream = g_converter_output_stream_new(buffered, G_CONVERTER(compressor));
+        g_object_unref(buffered);
+        g_object_unref(compressor);
+    }
+}
+
+/*!
+ * Write the queued output into the log files.
+ *
+ * Runs in its own thread so the main loop never waits for the disk.
+ *
+ * \param userData
+ * \return NULL
+ */
+static gpointer logWriter(gpointer userData) {
+    UNUSED(userData);
+    GError *error = NULL;
+    for (;;) {
+        LogMessage *message = g_async_queue_pop(logQueue);
+        TermLog *log = message->log;
+        switch (message->type) {
+            case TERM_LOG_OPEN:
+                openLog(log);
+                break;
+            case TERM_LOG_WRITE:
+                if (log->stream != NULL &&
+                    !g_output_stream_write_all(log->stream,
+                                               g_bytes_get_data(message->data, NULL),
+                                               g_bytes_get_size(message->data),
+                                               NULL, NULL, &error)) {
+                    fprintf(stderr, "Unable to write the log: %s\n", error->message);
+                    g_clear_error(&error);
+                }
+                g_bytes_unref(message->data);
+                break;
+            case TERM_LOG_CLOSE:
+                if (log->stream != NULL) {
+                    g_output_stream_close(log->stream, NULL, NULL);
+                    g_object_unref(log->stream);
+                }
+                g_free(log->path);
+                g_free(log);
+                break;
+            case TERM_LOG_SESSION:
+                writeSession(message->snapshot);
+                freeSessionSnapshot(message->snapshot);
+                break;
+            case TERM_LOG_QUIT:
+                g_free(message);
+                return NULL;
+        }
+        g_free(message);
+    }
+}
+
+/*!
+ * Queue a message for the log writer thread.
+ *
+ * \param type (TERM_LOG_*)
+ * \param log
+ * \param data (owned by the writer)
+ */
+static void queueLog(int type, TermLog *log, GBytes *data) {
+    LogMessage *message = g_new0(LogMessage, 1);
+    message->type = type;
+    message->log = log;
+    message->data = data;
+    g_async_queue_push(logQueue, message);
+}
+
+/*!
+ * Start the log writer thread.
+ */
+static void startLogWriter() {
+    if (logThread != NULL)
+        return;
+    logQueue = g_async_queue_new();
+    logThread = g_thread_new("log", logWriter, NULL);
+}
+
+/*!
+ * Queue the output rows since the last write.
+ *
+ * Only the rows above the cursor are written since the current row
+ * might still change.
+ *
+ * Nothing is written while the alternate screen (vim, less) is active.
+ * VTE doesn't tell which screen is active, but the alternate screen
+ * never has scrollback, so a terminal with no rows above the screen
+ * is skipped. The rows of a new terminal are still written once its
+ * output scrolls, since they are kept in the scrollback. Without any
+ * scrollback, the alternate screen is told by its own row numbers,
+ * which are below the logged rows.
+ *
+ * Rows that left a small scrollback within one update are lost, the
+ * log gets a line with their count instead.
+ *
+ * \param terminal
+ * \param log
+ * \param last (include the cursor row)
+ */
+static void writeLogRows(GtkWidget *terminal, TermLog *log, gboolean last) {
+    glong column, row;
+    vte_terminal_get_cursor_position(VTE_TERMINAL(terminal), &column, &row);
+    GtkAdjustment *adjustment = gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(terminal));
+    gboolean scrollback = gtk_adjustment_get_upper(adjustment) -
+        gtk_adjustment_get_lower(adjustment) > gtk_adjustment_get_page_size(adjustment);
+    /* Rows of the alternate screen are numbered on their own */
+    if (!scrollback && (row < log->row || (termScrollback != 0 && !last)))
+        return;
+    /* Rows are dropped from the scrollback before they are written */
+    glong lower = (glong)gtk_adjustment_get_lower(adjustment);
+    if (log->row < lower) {
+        gchar *dropped = g_strdup_printf(TERM_LOG_DROPPED, lower - log->row);
+        queueLog(TERM_LOG_WRITE, log, g_bytes_new_take(dropped, strlen(dropped)));
+        log->row = lower;
+    }
+    /* Terminal is reset */
+    log->row = MIN(log->row, row);
+    glong end = last ? row + 1 : row;
+    if (end <= log->row)
+        return;
+    gchar *text = vte_terminal_get_text_range(
+        VTE_TERMINAL(terminal), log->row, 0, end - 1,
+        vte_terminal_get_column_count(VTE_TERMINAL(terminal)) - 1, NULL, NULL, NULL);
+    log->row = end;
+    if (text != NULL)
+        queueLog(TERM_LOG_WRITE, log, g_bytes_new_take(text, strlen(text)));
+}
+
+/*!
+ * Log the changed contents of the terminal.
+ *
+ * \param terminal
+ * \param userData (TermLog)
+ */
+static void termLogOnChange(VteTerminal *terminal, gpointer userData) {
+    writeLogRows(GTK_WIDGET(terminal), userData, FALSE);
+}
+
+/*!
+ * Start logging the output of the terminal.
+ *
+ * \param terminal
+ */
+static void startLog(GtkWidget *terminal) {
+    startLogWriter();
+    TermLog *log = g_new0(TermLog, 1);
+    GDateTime *now = g_date_time_new_now_local();
+    gchar *time = g_date_time_format(now, "%Y%m%d-%H%M%S");
+    gchar *name = g_strdup_printf("%s-%s-%d-%u.log%s", TERM_NAME, time, getpid(),
+                                  ++logCount, logCompress ? ".gz" : "");
+    log->path = logDir != NULL ? g_build_filename(logDir, name, NULL) :
+        g_build_filename(g_get_user_data_dir(), TERM_NAME, "logs", name, NULL);
+    log->compress = logCompress;
+    /* Existing rows are not logged */
+    glong column;
+    vte_terminal_get_cursor_position(VTE_TERMINAL(terminal), &column, &log->row);
+    g_free(name);
+    g_free(time);
+    g_date_time_unref(now);
+    queueLog(TERM_LOG_OPEN, log, NULL);
+    g_object_set_data(G_OBJECT(terminal), TERM_DATA_LOG, log);
+    g_signal_connect(terminal, "contents-changed", G_CALLBACK(termLogOnChange), log);
+    g_signal_connect(terminal, "destroy", G_CALLBACK(stopLog), NULL);
+    printLog("log: %s\n", log->path);
+}
+
+/*!
+ * Stop logging the output of the terminal.
+ *
+ * \param terminal
+ */
+static void stopLog(GtkWidget *terminal) {
+    TermLog *log = g_object_steal_data(G_OBJECT(terminal), TERM_DATA_LOG);
+    if (log == NULL)
+        return;
+    writeLogRows(terminal, log, TRUE);
+    g_signal_handlers_disconnect_by_func(terminal, termLogOnChange, log);
+    g_signal_handlers_disconnect_by_func(terminal, stopLog, NULL);
+    queueLog(TERM_LOG_CLOSE, log, NULL);
+}
+
+/*!
+ * Flush the logs and stop the writer thread.
+ */
+static void stopLogWriter() {
+    if (logThread == NULL)
+        return;
+    /* Windows are still open on exit action */
+    for (int i = 0; i < termWindows->len; i++)
+        forEachTerm(((TermWindow *)g_ptr_array_index(termWindows, i))->notebook, stopLog);
+    queueLog(TERM_LOG_QUIT, NULL, NULL);
+    g_thread_join(logThread);
+    logThread = NULL;
+}
+
+/*!
+ * Write the pending broadcast input to the PTY of the terminal.
+ *
+ * \param broadcast
+ * \return TRUE if some input is still pending
+ */
+static gboolean writeBroadcast(Broadcast *broadcast) {
+    VtePty *pty = vte_terminal_get_pty(VTE_TERMINAL(broadcast->terminal));
+    if (pty == NULL) {
+        g_byte_array_set_size(broadcast->pending, 0);
+        return FALSE;
+    }
+    /* PTY of VTE is non-blocking, a full buffer returns EAGAIN */
+    ssize_t written = write(vte_pty_get_fd(pty), broadcast->pending->data,
+                            broadcast->pending->len);
+    if (written > 0)
+        g_byte_array_remove_range(broadcast->pending, 0, written);
+    else if (written == -1 && errno != EAGAIN && errno != EINTR)
+        g_byte_array_set_size(broadcast->pending, 0);
+    return broadcast->pending->len > 0;
+}
+
+/*!
+ * Continue writing the broadcast input when the PTY is writable.
+ *
+ * \param fd
+ * \param condition
+ * \param userData (Broadcast)
+ * \return TRUE while input is pending
+ */
+static gboolean broadcastOnWritable(gint fd, GIOCondition condition, gpointer userData) {
+    UNUSED(fd);
+    UNUSED(condition);
+    Broadcast *broadcast = userData;
+    if (writeBroadcast(broadcast))
+        return G_SOURCE_CONTINUE;
+    broadcast->watch = 0;
+    return G_SOURCE_REMOVE;
+}
+
+/*!
+ * Write the input of the main loop iteration to the broadcast terminals.
+ *
+ * \param userData
+ * \return FALSE for removing the source
+ */
+static gboolean broadcastOnFlush(gpointer userData) {
+    UNUSED(userData);
+    broadcastSource = 0;
+    for (int i = 0; i < broadcastTerms->len; i++) {
+        Broadcast *broadcast = g_ptr_array_index(broadcastTerms, i);
+        /* Blocked terminals continue on their watch */
+        if (broadcast->watch != 0 || broadcast->pending->len == 0)
+            continue;
+        if (writeBroadcast(broadcast))
+            broadcast->watch = g_unix_fd_add(
+                vte_pty_get_fd(vte_terminal_get_pty(VTE_TERMINAL(broadcast->terminal))),
+                G_IO_OUT, broadcastOnWritable, broadcast);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+/*!
+ * Queue the input of the terminal for the other broadcast terminals.
+ *
+ * \param terminal
+ * \param text
+ * \param size
+ */
+static void queueBroadcast(GtkWidget *terminal, const char *text, gsize size) {
+    if (g_object_get_data(G_OBJECT(terminal), TERM_DATA_BROADCAST) == NULL)
+        return;
+    for (int i = 0; i < broadcastTerms->len; i++) {
+        Broadcast *broadcast = g_ptr_array_index(broadcastTerms, i);
+        if (broadcast->terminal == terminal)
+            continue;
+        /* Drop the input of a terminal that doesn't read it */
+        if (broadcast->pending->len + size > TERM_BROADCAST_MAX) {
+            printLog("broadcast input dropped\n");
+            continue;
+        }
+        g_byte_array_append(broadcast->pending, (const guint8 *)text, size);
+    }
+    if (broadcastSource == 0)
+        broadcastSource = g_idle_add(broadcastOnFlush, NULL);
+}
+
+/*!
+ * Get the input that can be queued for the other broadcast terminals.
+ *
+ * \param terminal
+ * \return free space of the fullest terminal (G_MAXSIZE if not broadcasting)
+ */
+static gsize getBroadcastSpace(GtkWidget *terminal) {
+    gsize space = G_MAXSIZE;
+    if (g_object_get_data(G_OBJECT(terminal), TERM_DATA_BROADCAST) == NULL)
+        return space;
+    for (int i = 0; i < broadcastTerms->len; i++) {
+        Broadcast *broadcast = g_ptr_array_index(broadcastTerms, i);
+        if (broadcast->terminal != terminal)
+            space = MIN(space, TERM_BROADCAST_MAX - broadcast->pending->len);
+    }
+    return space;
+}
+
+/*!
+ * Queue the committed input of the terminal for the broadcast.
+ *
+ * \param terminal
+ * \param text
+ * \param size
+ * \param userData
+ */
+static void termOnCommit(VteTerminal *terminal, gchar *text, guint size,
+                         gpointer userData) {
+    UNUSED(userData);
+    queueBroadcast(GTK_WIDGET(terminal), text, size);
+}
+
+/*!
+ * Free the broadcast state of the terminal.
+ *
+ * \param data (Broadcast)
+ */
+static void freeBroadcast(gpointer data) {
+    Broadcast *broadcast = data;
+    g_ptr_array_remove(broadcastTerms, broadcast);
+    if (broadcast->watch != 0)
+        g_source_remove(broadcast->watch);
+    g_signal_handlers_disconnect_by_func(broadcast->terminal, termOnCommit, NULL);
+    g_byte_array_free(broadcast->pending, TRUE);
+    g_free(broadcast);
+}
+
+/*!
+ * Remove the destroyed terminal from the broadcast.
+ *
+ * \param terminal
+ * \param userData
+ */
+static void broadcastOnDestroy(GtkWidget *terminal, gpointer userData) {
+    UNUSED(userData);
+    g_object_set_data(G_OBJECT(terminal), TERM_DATA_BROADCAST, NULL);
+}
+
+/*!
+ * Add or remove the terminal from the broadcast.
+ *
+ * Input of a broadcast terminal (keys and pastes) is written to
+ * all other broadcast terminals.
+ *
+ * \param terminal
+ */
+static void toggleBroadcast(GtkWidget *terminal) {
+    if (g_object_get_data(G_OBJECT(terminal), TERM_DATA_BROADCAST) != NULL) {
+        g_signal_handlers_disconnect_by_func(terminal, broadcastOnDestroy, NULL);
+        g_object_set_data(G_OBJECT(terminal), TERM_DATA_BROADCAST, NULL);
+        return;
+    }
+    Broadcast *broadcast = g_new0(Broadcast, 1);
+    broadcast->terminal = terminal;
+    broadcast->pending = g_byte_array_new();
+    if (broadcastTerms == NULL)
+        broadcastTerms = g_ptr_array_new();
+    g_ptr_array_add(broadcastTerms, broadcast);
+    g_object_set_data_full(G_OBJECT(terminal), TERM_DATA_BROADCAST, broadcast, freeBroadcast);
+    g_signal_connect(terminal, "commit", G_CALLBACK(termOnCommit), NULL);
+    g_signal_connect(terminal, "destroy", G_CALLBACK(broadcastOnDestroy), NULL);
+}
+
+/*!
+ * Check if a terminal of the page is in the broadcast.
+ *
+ * \param page
+ * \return TRUE if the page is broadcasting
+ */
+static gboolean isBroadcastPage(GtkWidget *page) {
+    for (int i = 0; broadcastTerms != NULL && i < broadcastTerms->len; i++) {
+        GtkWidget *terminal = ((Broadcast *)g_ptr_array_index(broadcastTerms, i))->terminal;
+        if (terminal == page || gtk_widget_is_ancestor(terminal, page))
+            return TRUE;
+    }
+    return FALSE;
+}
+
+/*!
+ * Get the spawn arguments of the current configuration.
+ *
+ * The environment and the working directory are only read when
+ * the configuration generation changes, not for every tab.
+ *
+ * \return spawn spec
+ */
+static const SpawnSpec *getSpawnSpec() {
+    if (spawnSpec.generation == configGeneration)
+        return &spawnSpec;
+    spawnSpec.generation = configGeneration;
+    g_free(spawnSpec.shell);
+    g_free(spawnSpec.dir);
+    spawnSpec.shell = g_strdup(g_getenv("SHELL") ?: TERM_SHELL);
+    spawnSpec.argv[0] = spawnSpec.shell;
+    spawnSpec.argv[1] = NULL;
+    spawnSpec.dir = workingDir != NULL ? g_strdup(workingDir) : g_get_current_dir();
+    return &spawnSpec;
+}
+
+/*!
+ * Create a new terminal widget with a shell, without a log.
+ *
+ * \param dir (working directory, NULL for default)
+ * \param cmd (command to execute, NULL for shell)
+ * \return terminal
+ */
+static GtkWidget *spawnTerm(const char *dir, const char *cmd) {
+    /* Create a terminal widget */
+    GtkWidget *terminal = vte_terminal_new();
+    /* Terminal configuration */
+    connectSignals(terminal);
+    configureTerm(terminal);
+    /* Start a new shell, the command is layered on the shared spec */
+    const SpawnSpec *spec = getSpawnSpec();
+    char *commandArgv[] = { spec->shell, "-c", (char *)cmd, NULL };
+    char **argv = cmd != NULL ? commandArgv : (char **)spec->argv;
+    if (dir == NULL)
+        dir = spec->dir;
+    printLog("shell: %s, command: %s, workdir: %s\n", spec->shell, cmd ?: "-", dir);
+    /* Saved in the session */
+    g_object_set_data_full(G_OBJECT(terminal), TERM_DATA_DIR, g_strdup(dir), g_free);
+    g_object_set_data_full(G_OBJECT(terminal), TERM_DATA_COMMAND, g_strdup(cmd), g_free);
+    if (debugMessages) {
+        gint64 *spawnTime = g_new(gint64, 1);
+        *spawnTime = g_get_monotonic_time();
+        g_object_set_data_full(G_OBJECT(terminal), TERM_DATA_SPAWN_TIME, spawnTime, g_free);
+        g_signal_connect(terminal, "contents-changed", G_CALLBACK(termOnFirstOutput), NULL);
+    }
+    if (startupMarks != NULL)
+        g_signal_connect(terminal, "contents-changed", G_CALLBACK(startupOnOutput), NULL);
+    /* Spawn terminal asynchronously */
+    vte_terminal_spawn_async(VTE_TERMINAL(terminal),
+                             VTE_PTY_DEFAULT,   /* pty flag */
+                             dir,               /* working directory */
+                             argv,              /* argv */
+                             NULL,              /* environment variables */
+                             G_SPAWN_DEFAULT,   /* spawn flag */
+                             NULL,              /* child setup function */
+                             NULL,              /* child setup data */
+                             NULL,              /* child setup data destroy */
+                             -1,                /* timeout */
+                             NULL,              /* cancellable */
+                             termStateCallback, /* async callback */
+                             NULL);             /* callback data */
+    markStartup("spawn");
+    /* Show the terminal widget */
+    gtk_widget_show(terminal);
+    return terminal;
+}
+
+/*!
+ * Create a new terminal widget with a shell.
+ *
+ * \param dir (working directory, NULL for default)
+ * \param cmd (command to execute, NULL for shell)
+ * \return terminal
+ */
+static GtkWidget *getTerm(const char *dir, const char *cmd) {
+    GtkWidget *terminal = spawnTerm(dir, cmd);
+    if (logAll && !benchMode)
+        startLog(terminal);
+    return terminal;
+}
+
+/*!
+ * Fill the warm terminal pool up to the configured size.
+ *
+ * \param userData
+ * \return TRUE until the pool is full
+ */
+static gboolean refillPool(gpointer userData) {
+    UNUSED(userData);
+    while (g_queue_get_length(&warmPool) > prespawnCount) {
+        GtkWidget *terminal = g_queue_pop_tail(&warmPool);
+        gtk_widget_destroy(terminal);
+        g_object_unref(terminal);
+    }
+    if (g_queue_get_length(&warmPool) == prespawnCount) {
+        poolSource = 0;
+        return G_SOURCE_REMOVE;
+    }
+    /* Spawn one shell per idle iteration, logged once it is taken */
+    g_queue_push_tail(&warmPool, g_object_ref_sink(spawnTerm(NULL, NULL)));
+    printLog("warm pool: %u/%d\n", g_queue_get_length(&warmPool), prespawnCount);
+    return G_SOURCE_CONTINUE;
+}
+
+/*!
+ * Refill the warm terminal pool when the main loop is idle.
+ */
+static void schedulePoolRefill() {
+    if (poolSource == 0)
+        poolSource = g_idle_add_full(G_PRIORITY_LOW, refillPool, NULL, NULL);
+}
+
+/*!
+ * Get a terminal for a new tab.
+ *
+ * A terminal from the warm pool is used if the tab has the
+ * default working directory and shell.
+ *
+ * \param dir (working directory, NULL for default)
+ * \param cmd (command to execute, NULL for shell)
+ * \return terminal (with a reference)
+ */
+static GtkWidget *takeTerm(const char *dir, const char *cmd) {
+    GtkWidget *terminal = NULL;
+    if (cmd == NULL && (dir == NULL || !g_strcmp0(dir, getSpawnSpec()->dir)))
+        terminal = g_queue_pop_head(&warmPool);
+    if (terminal == NULL)
+        return g_object_ref_sink(getTerm(dir, cmd));
+    /* Configuration might have changed since the spawn */
+    if (GPOINTER_TO_UINT(g_object_get_data(G_OBJECT(terminal),
+                                           TERM_DATA_GENERATION)) != configGeneration)
+        configureTerm(terminal);
+    if (logAll && !benchMode)
+        startLog(terminal);
+    schedulePoolRefill();
+    return terminal;
+}
+
+/*!
+ * Append a new tab to the window.
+ *
+ * \param termWindow
+ * \param dir (working directory, NULL for default)
+ * \param cmd (command to execute, NULL for shell)
+ */
+static void appendTab(TermWindow *termWindow, const char *dir, const char *cmd) {
+    GtkWidget *terminal = takeTerm(dir, cmd);
+    gtk_notebook_append_page(GTK_NOTEBOOK(termWindow->notebook), terminal, NULL);
+    g_object_unref(terminal);
+    gtk_widget_show_all(termWindow->window);
+}
+
+/*!
+ * Replace the widget with another one in its parent container.
+ *
+ * The old widget is only removed, keep a reference to reuse it.
+ *
+ * \param widget
+ * \param replacement
+ */
+static void replaceWidget(GtkWidget *widget, GtkWidget *replacement) {
+    GtkWidget *parent = gtk_widget_get_parent(widget);
+    if (GTK_IS_NOTEBOOK(parent)) {
+        GtkNotebook *notebook = GTK_NOTEBOOK(parent);
+        TermWindow *termWindow = getTermWindow(parent);
+        int page = gtk_notebook_page_num(notebook, widget);
+        int current = gtk_notebook_get_current_page(notebook);
+        /* Page is replaced in place, without switching */
+        g_signal_handlers_block_by_func(notebook, termTabOnAdd, NULL);
+        g_signal_handlers_block_by_func(notebook, termTabOnSwitch, termWindow);
+        g_signal_handlers_block_by_func(notebook, termTabOnRemove, NULL);
+        gtk_notebook_remove_page(notebook, page);
+        gtk_notebook_insert_page(notebook, replacement, NULL, page);
+        gtk_widget_show(replacement);
+        gtk_notebook_set_current_page(notebook, current);
+        g_signal_handlers_unblock_by_func(notebook, termTabOnAdd, NULL);
+        g_signal_handlers_unblock_by_func(notebook, termTabOnSwitch, termWindow);
+        g_signal_handlers_unblock_by_func(notebook, termTabOnRemove, NULL);
+    } else if (GTK_IS_PANED(parent)) {
+        gboolean first = gtk_paned_get_child1(GTK_PANED(parent)) == widget;
+        gtk_container_remove(GTK_CONTAINER(parent), widget);
+        if (first)
+            gtk_paned_pack1(GTK_PANED(parent), replacement, TRUE, FALSE);
+        else
+            gtk_paned_pack2(GTK_PANED(parent), replacement, TRUE, FALSE);
+    } else if (GTK_IS_BOX(parent)) {
+        gtk_container_remove(GTK_CONTAINER(parent), widget);
+        gtk_box_pack_start(GTK_BOX(parent), replacement, TRUE, TRUE, 0);
+    }
+}
+
+/*!
+ * Stop rewrapping the terminal until the resize settles.
+ *
+ * \param terminal
+ */
+static void holdRewrap(GtkWidget *terminal) {
+    if (g_object_get_data(G_OBJECT(terminal), TERM_DATA_COLUMNS) != NULL)
+        return;
+    g_object_set_data(G_OBJECT(terminal), TERM_DATA_COLUMNS,
+                      GINT_TO_POINTER(vte_terminal_get_column_count(VTE_TERMINAL(terminal)) + 1));
+    vte_terminal_set_rewrap_on_resize(VTE_TERMINAL(terminal), FALSE);
+}
+
+/*!
+ * Rewrap the terminal once from the size before the resize.
+ *
+ * \param terminal
+ */
+static void releaseRewrap(GtkWidget *terminal) {
+    glong columns = GPOINTER_TO_INT(g_object_steal_data(G_OBJECT(terminal),
+                                                        TERM_DATA_COLUMNS)) - 1;
+    if (columns < 0)
+        return;
+    if (termRewrap == TERM_REWRAP_OFF)
+        return;
+    vte_terminal_set_rewrap_on_resize(VTE_TERMINAL(terminal), TRUE);
+    glong current = vte_terminal_get_column_count(VTE_TERMINAL(terminal));
+    glong rows = vte_terminal_get_row_count(VTE_TERMINAL(terminal));
+    /* Content still has the old width, rewrap it to the new one */
+    if (columns != current) {
+        vte_terminal_set_size(VTE_TERMINAL(terminal), columns, rows);
+        vte_terminal_set_size(VTE_TERMINAL(terminal), current, rows);
+    }
+}
+
+/*!
+ * Remove the timer source that is stored as object data.
+ *
+ * \param data (source id)
+ */
+static void removeSource(gpointer data) {
+    g_source_remove(GPOINTER_TO_UINT(data));
+}
+
+/*!
+ * Rewrap the terminals of the split after the divider drag.
+ *
+ * \param userData (split)
+ * \return FALSE for removing the source
+ */
+static gboolean splitOnSettle(gpointer userData) {
+    g_object_steal_data(G_OBJECT(userData), TERM_DATA_SETTLE);
+    forEachTerm(userData, releaseRewrap);
+    return G_SOURCE_REMOVE;
+}
+
+/*!
+ * Coalesce the resizes of the terminals while the divider is dragged.
+ *
+ * \param paned
+ * \param pspec
+ * \param userData
+ */
+static void splitOnMove(GtkPaned *paned, GParamSpec *pspec, gpointer userData) {
+    UNUSED(pspec);
+    UNUSED(userData);
+    /* Initial position */
+    if (termRewrap != TERM_REWRAP_LAZY ||
+        g_object_get_data(G_OBJECT(paned), TERM_DATA_RATIO) != NULL)
+        return;
+    forEachTerm(GTK_WIDGET(paned), holdRewrap);
+    g_object_set_data_full(G_OBJECT(paned), TERM_DATA_SETTLE,
+                           GUINT_TO_POINTER(g_timeout_add(TERM_SPLIT_DELAY,
+                                                          splitOnSettle, paned)),
+                           removeSource);
+}
+
+/*!
+ * Set the divider position from the ratio on the first allocation.
+ *
+ * \param widget
+ * \param allocation
+ * \param userData
+ */
+static void splitOnAllocate(GtkWidget *widget, GtkAllocation *allocation,
+                            gpointer userData) {
+    UNUSED(userData);
+    int ratio = GPOINTER_TO_INT(g_object_get_data(G_OBJECT(widget), TERM_DATA_RATIO));
+    int size = gtk_orientable_get_orientation(GTK_ORIENTABLE(widget)) ==
+        GTK_ORIENTATION_HORIZONTAL ? allocation->width : allocation->height;
+    if (ratio == 0 || size <= 1)
+        return;
+    g_object_set_data(G_OBJECT(widget), TERM_DATA_RATIO, NULL);
+    gtk_paned_set_position(GTK_PANED(widget), size * ratio / TERM_SPLIT_SCALE);
+}
+
+/*!
+ * Get the divider position of the split.
+ *
+ * \param paned
+ * \return ratio (1/TERM_SPLIT_SCALE of the size)
+ */
+static int getSplitRatio(GtkWidget *paned) {
+    int ratio = GPOINTER_TO_INT(g_object_get_data(G_OBJECT(paned), TERM_DATA_RATIO));
+    int size = gtk_orientable_get_orientation(GTK_ORIENTABLE(paned)) ==
+        GTK_ORIENTATION_HORIZONTAL ? gtk_widget_get_allocated_width(paned) :
+        gtk_widget_get_allocated_height(paned);
+    if (ratio != 0 || size <= 1)
+        return ratio ?: TERM_SPLIT_SCALE / 2;
+    return CLAMP(gtk_paned_get_position(GTK_PANED(paned)) * TERM_SPLIT_SCALE / size,
+                 1, TERM_SPLIT_SCALE - 1);
+}
+
+/*!
+ * Create a split of two panes.
+ *
+ * \param orientation
+ * \param ratio (divider position, 1/TERM_SPLIT_SCALE of the size)
+ * \return split
+ */
+static GtkWidget *newSplit(GtkOrientation orientation, int ratio) {
+    GtkWidget *paned = gtk_paned_new(orientation);
+    g_object_set_data(G_OBJECT(paned), TERM_DATA_SPLIT, GINT_TO_POINTER(TRUE));
+    g_object_set_data(G_OBJECT(paned), TERM_DATA_RATIO,
+                      GINT_TO_POINTER(CLAMP(ratio, 1, TERM_SPLIT_SCALE - 1)));
+    g_signal_connect(paned, "size-allocate", G_CALLBACK(splitOnAllocate), NULL);
+    g_signal_connect(paned, "notify::position", G_CALLBACK(splitOnMove), NULL);
+    return paned;
+}
+
+/*!
+ * Split the terminal into two panes.
+ *
+ * The new pane starts in the current directory of the terminal.
+ *
+ * \param terminal
+ * \param orientation (horizontal for side by side panes)
+ */
+static void splitTerm(GtkWidget *terminal, GtkOrientation orientation) {
+    gchar *dir = getTermDir(terminal);
+    GtkWidget *pane = getTerm(dir, NULL);
+    GtkWidget *paned = newSplit(orientation, TERM_SPLIT_SCALE / 2);
+    g_free(dir);
+    g_object_ref(terminal);
+    replaceWidget(terminal, paned);
+    gtk_paned_pack1(GTK_PANED(paned), terminal, TRUE, FALSE);
+    gtk_paned_pack2(GTK_PANED(paned), pane, TRUE, FALSE);
+    g_object_unref(terminal);
+    gtk_widget_show(paned);
+    gtk_widget_grab_focus(pane);
+}
+
+/*!
+ * Close the pane of the terminal, the other pane takes its place.
+ *
+ * \param terminal
+ * \return TRUE if the terminal was in a split
+ */
+static gboolean closePane(GtkWidget *terminal) {
+    GtkWidget *paned = gtk_widget_get_parent(terminal);
+    if (paned == NULL || g_object_get_data(G_OBJECT(paned), TERM_DATA_SPLIT) == NULL)
+        return FALSE;
+    GtkWidget *sibling = gtk_paned_get_child1(GTK_PANED(paned));
+    if (sibling == terminal)
+        sibling = gtk_paned_get_child2(GTK_PANED(paned));
+    g_object_ref(paned);
+    g_object_ref(sibling);
+    gtk_container_remove(GTK_CONTAINER(paned), sibling);
+    replaceWidget(paned, sibling);
+    g_object_unref(sibling);
+    gtk_widget_destroy(paned);
+    g_object_unref(paned);
+    GtkWidget *focus = getPageTerm(sibling);
+    if (focus != NULL)
+        gtk_widget_grab_focus(focus);
+    return TRUE;
+}
+
+/*!
+ * Check the layout of the split panes.
+ *
+ * Layout is either "t" for a terminal or "h|v<ratio>(<layout>,<layout>)"
+ * for a horizontal or vertical split.
+ *
+ * \param layout (moved to the end of the layout)
+ * \return count of the panes (-1 if the layout is not valid)
+ */
+static int checkLayout(const char **layout) {
+    if (**layout == 't') {
+        (*layout)++;
+        return 1;
+    }
+    if (**layout != 'h' && **layout != 'v')
+        return -1;
+    char *end;
+    strtol(*layout + 1, &end, 10);
+    if (*end != '(')
+        return -1;
+    *layout = end + 1;
+    int first = checkLayout(layout);
+    if (first < 0 || *(*layout)++ != ',')
+        return -1;
+    int second = checkLayout(layout);
+    if (second < 0 || *(*layout)++ != ')')
+        return -1;
+    return first + second;
+}
+
+/*!
+ * Append the layout of the split panes and their terminals (in order).
+ *
+ * \param widget
+ * \param layout
+ * \param terminals
+ */
+static void getLayout(GtkWidget *widget, GString *layout, GPtrArray *terminals) {
+    if (VTE_IS_TERMINAL(widget)) {
+        g_string_append_c(layout, 't');
+        g_ptr_array_add(terminals, widget);
+    } else if (g_object_get_data(G_OBJECT(widget), TERM_DATA_SPLIT) != NULL) {
+        g_string_append_printf(layout, "%c%d(",
+                               gtk_orientable_get_orientation(GTK_ORIENTABLE(widget)) ==
+                               GTK_ORIENTATION_HORIZONTAL ? 'h' : 'v',
+                               getSplitRatio(widget));
+        getLayout(gtk_paned_get_child1(GTK_PANED(widget)), layout, terminals);
+        g_string_append_c(layout, ',');
+        getLayout(gtk_paned_get_child2(GTK_PANED(widget)), layout, terminals);
+        g_string_append_c(layout, ')');
+    } else if (GTK_IS_CONTAINER(widget)) {
+        /* Placeholder box of a spawned lazy tab */
+        GList *children = gtk_container_get_children(GTK_CONTAINER(widget));
+        if (children != NULL)
+            getLayout(children->data, layout, terminals);
+        g_list_free(children);
+    }
+}
+
+/*!
+ * Compress or decompress the data with the converter.
+ *
+ * \param converter
+ * \param input
+ * \param sizeHint (expected output size)
+ * \return output (NULL on error)
+ */
+static GBytes *convertBytes(GConverter *converter, GBytes *input, gsize sizeHint) {
+    GError *error = NULL;
+    GByteArray *output = g_byte_array_sized_new(sizeHint);
+    guint8 buf[TERM_BUFFER_SIZE];
+    gsize size, bytesRead, bytesWritten;
+    const guint8 *data = g_bytes_get_data(input, &size);
+    GConverterResult result;
+    do {
+        result = g_converter_convert(converter, data, size, buf, sizeof(buf),
+                                     G_CONVERTER_INPUT_AT_END, &bytesRead,
+                                     &bytesWritten, &error);
+        if (result == G_CONVERTER_ERROR) {
+            printLog("An error occurred: %s\n", error->message);
+            g_clear_error(&error);
+            g_byte_array_free(output, TRUE);
+            return NULL;
+        }
+        data += bytesRead;
+        size -= bytesRead;
+        g_byte_array_append(output, buf, bytesWritten);
+    } while (result != G_CONVERTER_FINISHED);
+    return g_byte_array_free_to_bytes(output);
+}
+
+/*!
+ * Feed the text lines into the terminal.
+ *
+ * \param terminal
+ * \param text
+ * \param size
+ */
+static void feedLines(GtkWidget *terminal, const char *text, gsize size) {
+    GString *data = g_string_sized_new(size + size / TERM_CONFIG_LENGTH);
+    for (gsize i = 0; i < size; i++) {
+        /* Line feed doesn't return the cursor */
+        if (text[i] == '\n')
+            g_string_append_c(data, '\r');
+        g_string_append_c(data, text[i]);
+    }
+    vte_terminal_feed(VTE_TERMINAL(terminal), data->str, data->len);
+    g_string_free(data, TRUE);
+}
+
+/*!
+ * Free the pane of a lazy tab.
+ *
+ * \param data (LazyPane)
+ */
+static void freeLazyPane(gpointer data) {
+    LazyPane *lazyPane = data;
+    g_free(lazyPane->dir);
+    g_free(lazyPane->command);
+    g_free(lazyPane->title);
+    if (lazyPane->scrollback != NULL)
+        g_bytes_unref(lazyPane->scrollback);
+    g_free(lazyPane);
+}
+
+/*!
+ * Free the lazy tab.
+ *
+ * \param data (LazyTab)
+ */
+static void freeLazyTab(gpointer data) {
+    LazyTab *lazyTab = data;
+    g_free(lazyTab->layout);
+    g_ptr_array_free(lazyTab->panes, TRUE);
+    g_free(lazyTab);
+}
+
+/*!
+ * Create a lazy tab without panes.
+ *
+ * \return lazy tab
+ */
+static LazyTab *newLazyTab() {
+    LazyTab *lazyTab = g_new0(LazyTab, 1);
+    lazyTab->panes = g_ptr_array_new_with_free_func(freeLazyPane);
+    return lazyTab;
+}
+
+/*!
+ * Create the placeholder page of a lazy tab.
+ *
+ * \param lazyTab (owned by the page)
+ * \return page
+ */
+static GtkWidget *newLazyPage(LazyTab *lazyTab) {
+    GtkWidget *page = gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
+    g_object_set_data_full(G_OBJECT(page), TERM_DATA_LAZY, lazyTab, freeLazyTab);
+    gtk_widget_show(page);
+    return page;
+}
+
+/*!
+ * Get the restored title without the characters that end its sequence.
+ *
+ * Control characters (also C1, like ST) are dropped and invalid UTF-8
+ * bytes are replaced.
+ *
+ * \param title
+ * \return title (free with g_free)
+ */
+static gchar *getSessionTitle(const char *title) {
+    GString *clean = g_string_new(NULL);
+    const gchar *end;
+    while (!g_utf8_validate(title, -1, &end)) {
+        g_string_append_len(clean, title, end - title);
+        g_string_append_c(clean, '?');
+        title = end + 1;
+    }
+    g_string_append(clean, title);
+    for (gchar *c = clean->str; *c;) {
+        gchar *next = g_utf8_next_char(c);
+        if (g_unichar_iscntrl(g_utf8_get_char(c)))
+            memmove(c, next, strlen(next) + 1);
+        else
+            c = next;
+    }
+    return g_string_free(clean, FALSE);
+}
+
+/*!
+ * Spawn the terminal of a lazy pane.
+ *
+ * The restored scrollback and title are fed before the shell output.
+ *
+ * \param lazyPane
+ * \return terminal
+ */
+static GtkWidget *spawnLazyPane(LazyPane *lazyPane) {
+    GtkWidget *terminal = getTerm(lazyPane->dir, lazyPane->command);
+    if (lazyPane->scrollback != NULL) {
+        GConverter *decompressor = G_CONVERTER(
+            g_zlib_decompressor_new(G_ZLIB_COMPRESSOR_FORMAT_RAW));
+        GBytes *text = convertBytes(decompressor, lazyPane->scrollback,
+                                    lazyPane->scrollbackSize);
+        if (text != NULL) {
+            feedLines(terminal, g_bytes_get_data(text, NULL), g_bytes_get_size(text));
+            g_bytes_unref(text);
+        }
+        g_object_unref(decompressor);
+    }
+    if (lazyPane->title != NULL && *lazyPane->title) {
+        gchar *clean = getSessionTitle(lazyPane->title);
+        gchar *title = g_strdup_printf("\033]2;%s\007", clean);
+        vte_terminal_feed(VTE_TERMINAL(terminal), title, -1);
+        g_free(title);
+        g_free(clean);
+    }
+    return terminal;
+}
+
+/*!
+ * Spawn the split panes of the (checked) layout.
+ *
+ * \param layout (moved to the end of the layout)
+ * \param lazyTab
+ * \param pane (index of the next pane)
+ * \return widget
+ */
+static GtkWidget *buildLayout(const char **layout, LazyTab *lazyTab, guint *pane) {
+    if (*(*layout)++ == 't')
+        return spawnLazyPane(g_ptr_array_index(lazyTab->panes, (*pane)++));
+    GtkOrientation orientation = (*layout)[-1] == 'h' ? GTK_ORIENTATION_HORIZONTAL :
+                                                        GTK_ORIENTATION_VERTICAL;
+    char *end;
+    int ratio = strtol(*layout, &end, 10);
+    GtkWidget *paned = newSplit(orientation, ratio);
+    *layout = end + 1;
+    gtk_paned_pack1(GTK_PANED(paned), buildLayout(layout, lazyTab, pane), TRUE, FALSE);
+    (*layout)++;
+    gtk_paned_pack2(GTK_PANED(paned), buildLayout(layout, lazyTab, pane), TRUE, FALSE);
+    (*layout)++;
+    gtk_widget_show(paned);
+    return paned;
+}
+
+/*!
+ * Spawn the terminals of a lazy tab inside its placeholder page.
+ *
+ * Only the first pane is spawned if the layout is not valid.
+ *
+ * \param page
+ */
+static void spawnLazyTab(GtkWidget *page) {
+    LazyTab *lazyTab = g_object_get_data(G_OBJECT(page), TERM_DATA_LAZY);
+    const char *layout = lazyTab->layout;
+    GtkWidget *root;
+    guint pane = 0;
+    if (layout != NULL && checkLayout(&layout) == (int)lazyTab->panes->len && !*layout) {
+        layout = lazyTab->layout;
+        root = buildLayout(&layout, lazyTab, &pane);
+    } else {
+        root = spawnLazyPane(g_ptr_array_index(lazyTab->panes, 0));
+    }
+    g_object_set_data(G_OBJECT(page), TERM_DATA_LAZY, NULL);
+    gtk_box_pack_start(GTK_BOX(page), root, TRUE, TRUE, 0);
+    gtk_widget_grab_focus(getPageTerm(root));
+    printLog("lazy tab spawned\n");
+}
+
+/*!
+ * Append a new tab to the window without switching to it.
+ *
+ * The tab is lazy unless a command is given: only an empty page
+ * is created and the terminal is spawned when the tab is switched to.
+ *
+ * \param termWindow
+ * \param dir (working directory, NULL for default)
+ * \param cmd (command to execute, NULL for shell)
+ */
+static void appendBackgroundTab(TermWindow *termWindow, const char *dir, const char *cmd) {
+    GtkWidget *page;
+    if (cmd != NULL) {
+        page = getTerm(dir, cmd);
+    } else {
+        LazyTab *lazyTab = newLazyTab();
+        LazyPane *lazyPane = g_new0(LazyPane, 1);
+        lazyPane->dir = g_strdup(dir);
+        g_ptr_array_add(lazyTab->panes, lazyPane);
+        page = newLazyPage(lazyTab);
+    }
+    g_object_set_data(G_OBJECT(page), TERM_DATA_BACKGROUND, GINT_TO_POINTER(TRUE));
+    gtk_notebook_append_page(GTK_NOTEBOOK(termWindow->notebook), page, NULL);
+}
+
+/*!
+ * Invalidate the default binding with the corresponding action
+ *
+ * \param binding
+ */
+static void invalidateDefaultBinding(const Bindings *binding) {
+    for (int i = 0; i < defaultKeyCount; i++) {
+        if (strcmp(defaultKeyBindings[i].bind.cmd, binding->cmd) == 0
+            && defaultKeyBindings[i].bind.internal == binding->internal) {
+            defaultKeyBindings[i].invalid = TRUE;
+        }
+    }
+}
+
+/*!
+ * Get the key value of the given key name (case-insensitive).
+ *
+ * The name is tried as given, in lowercase (a, f1 is F1 below), in
+ * uppercase and with its words capitalized (return, page_down).
+ *
+ * \param name
+ * \return key value (lowercase)
+ */
+static guint getKeyval(const char *name) {
+    guint keyval = gdk_keyval_from_name(name);
+    if (keyval != GDK_KEY_VoidSymbol)
+        return gdk_keyval_to_lower(keyval);
+    gchar *forms[3];
+    forms[0] = g_ascii_strdown(name, -1);
+    forms[1] = g_ascii_strup(name, -1);
+    /* Capitalize the words of the name */
+    forms[2] = g_strdup(forms[0]);
+    for (char *c = forms[2]; *c; c++)
+        if (c == forms[2] || c[-1] == '_')
+            *c = g_ascii_toupper(*c);
+    for (int i = 0; i < G_N_ELEMENTS(forms); i++) {
+        if (keyval == GDK_KEY_VoidSymbol)
+            keyval = gdk_keyval_from_name(forms[i]);
+        g_free(forms[i]);
+    }
+    return gdk_keyval_to_lower(keyval);
+}
+
+/*!
+ * Add the binding to the key table.
+ *
+ * \param binding
+ * \param replace (override the binding of the same key)
+ */
+static void addKeyBinding(Bindings *binding, gboolean replace) {
+    guint keyval = getKeyval(binding->key);
+    if (keyval == GDK_KEY_VoidSymbol) {
+        fprintf(stderr, "Unknown key '%s' for '%s'\n", binding->key, binding->cmd);
+        return;
+    }
+    binding->action = binding->internal ? getAction(binding->cmd) : NULL;
+    if (replace || g_hash_table_lookup(keyTable, GUINT_TO_POINTER(keyval)) == NULL)
+        g_hash_table_insert(keyTable, GUINT_TO_POINTER(keyval), binding);
+}
+
+/*!
+ * Resolve the key bindings into key table for the key press events.
+ */
+static void buildKeyTable() {
+    if (keyTable == NULL)
+        keyTable = g_hash_table_new(g_direct_hash, g_direct_equal);
+    g_hash_table_remove_all(keyTable);
+    /* First custom binding wins over the later ones */
+    for (int i = 0; keyBindings != NULL && i < keyBindings->len; i++)
+        addKeyBinding(&g_array_index(keyBindings, Bindings, i), FALSE);
+    /* Default bindings take precedence over the custom ones */
+    for (int i = 0; i < defaultKeyCount; i++) {
+        if (!defaultKeyBindings[i].invalid)
+            addKeyBinding(&defaultKeyBindings[i].bind, TRUE);
+    }
+}
+
+/*!
+ * Release the reference of the scrollback block.
+ *
+ * \param data (SearchBlock)
+ */
+static void unrefSearchBlock(gpointer data) {
+    SearchBlock *block = data;
+    if (!g_atomic_int_dec_and_test(&block->refCount))
+        return;
+    g_free(block->text);
+    g_array_free(block->offsets, TRUE);
+    g_free(block);
+}
+
+/*!
+ * Release the reference of the search.
+ *
+ * \param search
+ */
+static void unrefSearch(Search *search) {
+    if (!g_atomic_int_dec_and_test(&search->refCount))
+        return;
+    g_regex_unref(search->regex);
+    if (search->vteRegex != NULL)
+        vte_regex_unref(search->vteRegex);
+    g_object_unref(search->cancellable);
+    g_array_free(search->matches, TRUE);
+    g_free(search);
+}
+
+/*!
+ * Free the scrollback index of the terminal.
+ *
+ * \param data (SearchIndex)
+ */
+static void freeSearchIndex(gpointer data) {
+    SearchIndex *index = data;
+    g_ptr_array_free(index->blocks, TRUE);
+    g_free(index);
+}
+
+/*!
+ * Read the rows of the terminal into a scrollback block.
+ *
+ * \param terminal
+ * \param start (first row)
+ * \param end (last row + 1)
+ * \return block
+ */
+static SearchBlock *readSearchBlock(GtkWidget *terminal, glong start, glong end) {
+    SearchBlock *block = g_new0(SearchBlock, 1);
+    GString *text = g_string_new(NULL);
+    glong columns = vte_terminal_get_column_count(VTE_TERMINAL(terminal));
+    block->refCount = 1;
+    block->row = start;
+    block->offsets = g_array_sized_new(FALSE, FALSE, sizeof(gsize), end - start);
+    /* One line per row, so a match maps to its row */
+    for (glong row = start; row < end; row++) {
+        gchar *line = vte_terminal_get_text_range(VTE_TERMINAL(terminal), row, 0, row,
+                                                  columns - 1, NULL, NULL, NULL);
+        g_array_append_val(block->offsets, text->len);
+        if (line != NULL) {
+            g_string_append(text, g_strdelimit(line, "\n", ' '));
+            g_free(line);
+        }
+        g_string_append_c(text, '\n');
+    }
+    block->length = text->len;
+    block->text = g_string_free(text, FALSE);
+    return block;
+}
+
+/*!
+ * Check if the first row of the block is still in the terminal.
+ *
+ * A reset or a cleared scrollback reuses the row numbers for other
+ * text, so the blocks of the old rows are not valid anymore.
+ *
+ * \param terminal
+ * \param block
+ * \return TRUE if the block is valid
+ */
+static gboolean checkSearchBlock(GtkWidget *terminal, SearchBlock *block) {
+    glong columns = vte_terminal_get_column_count(VTE_TERMINAL(terminal));
+    gchar *line = vte_terminal_get_text_range(VTE_TERMINAL(terminal), block->row, 0,
+                                              block->row, columns - 1, NULL, NULL, NULL);
+    gsize length = (block->offsets->len > 1 ?
+                    g_array_index(block->offsets, gsize, 1) : block->length) - 1;
+    gboolean valid = line != NULL ? strlen(line) == length &&
+        !memcmp(g_strdelimit(line, "\n", ' '), block->text, length) : length == 0;
+    g_free(line);
+    return valid;
+}
+
+/*!
+ * Search the regex in the scrollback block (in the worker thread).
+ *
+ * \param data (SearchJob)
+ * \param userData
+ */
+static void searchWorker(gpointer data, gpointer userData) {
+    UNUSED(userData);
+    SearchJob *job = data;
+    SearchBlock *block = job->block;
+    GMatchInfo *matchInfo;
+    job->rows = g_array_new(FALSE, FALSE, sizeof(glong));
+    if (!g_cancellable_is_cancelled(job->search->cancellable)) {
+        g_regex_match_full(job->search->regex, block->text, block->length, 0, 0,
+                           &matchInfo, NULL);
+        guint line = 0;
+        glong last = -1;
+        while (g_match_info_matches(matchInfo)) {
+            gint start;
+            g_match_info_fetch_pos(matchInfo, 0, &start, NULL);
+            /* Matches are in order, find the line of the match */
+            while (line + 1 < block->offsets->len &&
+                   g_array_index(block->offsets, gsize, line + 1) <= start)
+                line++;
+            glong row = block->row + line;
+            if (row != last)
+                g_array_append_val(job->rows, row);
+            last = row;
+            g_match_info_next(matchInfo, NULL);
+        }
+        g_match_info_free(matchInfo);
+    }
+    g_idle_add(searchOnResult, job);
+}
+
+/*!
+ * Queue the scrollback block for the worker thread.
+ *
+ * \param search
+ * \param block
+ */
+static void queueSearchBlock(Search *search, SearchBlock *block) {
+    SearchJob *job = g_new0(SearchJob, 1);
+    g_atomic_int_inc(&search->refCount);
+    g_atomic_int_inc(&block->refCount);
+    job->search = search;
+    job->block = block;
+    search->pendingJobs++;
+    if (searchPool == NULL)
+        searchPool = g_thread_pool_new(searchWorker, NULL, 1, FALSE, NULL);
+    g_thread_pool_push(searchPool, job, NULL);
+}
+
+/*!
+ * Update the label of the search bar.
+ *
+ * \param termWindow
+ */
+static void updateSearchLabel(TermWindow *termWindow) {
+    Search *search = termWindow->search;
+    gchar *text;
+    if (search == NULL || search->matches->len == 0)
+        text = g_strdup(search != NULL && search->pendingJobs ? "..." : "0/0");
+    else
+        text = g_strdup_printf("%d/%u%s", search->current + 1, search->matches->len,
+                               search->pendingJobs ? "..." : "");
+    gtk_label_set_text(GTK_LABEL(termWindow->searchLabel), text);
+    g_free(text);
+}
+
+/*!
+ * Scroll the terminal to the current match.
+ *
+ * \param search
+ */
+static void showSearchMatch(Search *search) {
+    if (search->terminal == NULL || search->current < 0)
+        return;
+    glong row = g_array_index(search->matches, glong, search->current);
+    GtkAdjustment *adjustment =
+        gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(search->terminal));
+    gdouble pageSize = gtk_adjustment_get_page_size(adjustment);
+    if (search->vteRegex != NULL) {
+        /* Without a selection, VTE searches from the top of the view */
+        glong top = MIN(row, (glong)(gtk_adjustment_get_upper(adjustment) - pageSize));
+        int skip = search->current;
+        while (skip > 0 && g_array_index(search->matches, glong, skip - 1) >= top)
+            skip--;
+        vte_terminal_unselect_all(VTE_TERMINAL(search->terminal));
+        gtk_adjustment_set_value(adjustment, top);
+        for (int i = skip; i <= search->current; i++)
+            vte_terminal_search_find_next(VTE_TERMINAL(search->terminal));
+    }
+    /* Center the row in the view */
+    gtk_adjustment_set_value(adjustment,
+                             CLAMP(row - pageSize / 2, gtk_adjustment_get_lower(adjustment),
+                                   gtk_adjustment_get_upper(adjustment) - pageSize));
+    updateSearchLabel(search->termWindow);
+}
+
+/*!
+ * Merge the matches of a block into the search (in the main thread).
+ *
+ * \param userData (SearchJob)
+ * \return FALSE for removing the source
+ */
+static gboolean searchOnResult(gpointer userData) {
+    SearchJob *job = userData;
+    Search *search = job->search;
+    search->pendingJobs--;
+    /* Rows that are dropped from the scrollback since the index */
+    guint dropped = 0;
+    while (dropped < job->rows->len &&
+           g_array_index(job->rows, glong, dropped) < search->indexStart)
+        dropped++;
+    g_array_remove_range(job->rows, 0, dropped);
+    if (!g_cancellable_is_cancelled(search->cancellable) && job->rows->len) {
+        /* Blocks don't overlap, insert the rows at once */
+        glong first = g_array_index(job->rows, glong, 0);
+        guint position = 0;
+        while (position < search->matches->len &&
+               g_array_index(search->matches, glong, position) < first)
+            position++;
+        g_array_insert_vals(search->matches, position, job->rows->data, job->rows->len);
+        if (search->current >= (int)position)
+            search->current += job->rows->len;
+        /* Jump to the latest match of the first results */
+        if (search->current < 0) {
+            search->current = search->matches->len - 1;
+            showSearchMatch(search);
+        }
+    }
+    if (!g_cancellable_is_cancelled(search->cancellable))
+        updateSearchLabel(search->termWindow);
+    g_array_free(job->rows, TRUE);
+    unrefSearchBlock(job->block);
+    unrefSearch(search);
+    g_free(job);
+    return G_SOURCE_REMOVE;
+}
+
+/*!
+ * Index the new scrollback rows of the terminal (in chunks on idle).
+ *
+ * \param userData (Search)
+ * \return TRUE until the rows are indexed
+ */
+static gboolean searchOnIndex(gpointer userData) {
+    Search *search = userData;
+    if (search->terminal == NULL) {
+        search->indexSource = 0;
+        return G_SOURCE_REMOVE;
+    }
+    SearchIndex *index = g_object_get_data(G_OBJECT(search->terminal), TERM_DATA_SEARCH);
+    glong end = MIN(index->end + TERM_SEARCH_CHUNK, search->indexEnd);
+    SearchBlock *block = readSearchBlock(search->terminal, index->end, end);
+    g_ptr_array_add(index->blocks, block);
+    index->end = end;
+    queueSearchBlock(search, block);
+    if (end < search->indexEnd)
+        return G_SOURCE_CONTINUE;
+    search->indexSource = 0;
+    return G_SOURCE_REMOVE;
+}
+
+/*!
+ * Cancel the running search of the window.
+ *
+ * \param termWindow
+ */
+static void cancelSearch(TermWindow *termWindow) {
+    Search *search = termWindow->search;
+    if (search == NULL)
+        return;
+    termWindow->search = NULL;
+    g_cancellable_cancel(search->cancellable);
+    if (search->indexSource != 0)
+        g_source_remove(search->indexSource);
+    if (search->terminal != NULL) {
+        /* Remove the highlight of the last match */
+        if (search->current >= 0)
+            vte_terminal_unselect_all(VTE_TERMINAL(search->terminal));
+        vte_terminal_search_set_regex(VTE_TERMINAL(search->terminal), NULL, 0);
+        g_object_remove_weak_pointer(G_OBJECT(search->terminal),
+                                     (gpointer *)&search->terminal);
+    }
+    search->terminal = NULL;
+    unrefSearch(search);
+}
+
+/*!
+ * Search the pattern in the scrollback of the current tab.
+ *
+ * Finished scrollback rows are indexed once into immutable blocks and
+ * reused by the later searches. The blocks are matched in a worker
+ * thread (the visible rows first, then the newest blocks) and the
+ * matches are merged as they are found.
+ *
+ * \param termWindow
+ * \param pattern
+ */
+static void startSearch(TermWindow *termWindow, const char *pattern) {
+    cancelSearch(termWindow);
+    GtkNotebook *notebook = GTK_NOTEBOOK(termWindow->notebook);
+    GtkWidget *terminal = getPageTerm(gtk_notebook_get_nth_page(notebook,
+                                      gtk_notebook_get_current_page(notebook)));
+    if (terminal == NULL || *pattern == 0) {
+        updateSearchLabel(termWindow);
+        return;
+    }
+    /* Smart case, invalid regexes are searched literally */
+    GRegexCompileFlags flags = G_REGEX_OPTIMIZE | G_REGEX_MULTILINE;
+    guint32 vteFlags = PCRE2_UTF | PCRE2_MULTILINE;
+    gchar *lower = g_utf8_strdown(pattern, -1);
+    if (!strcmp(lower, pattern)) {
+        flags |= G_REGEX_CASELESS;
+        vteFlags |= PCRE2_CASELESS;
+    }
+    g_free(lower);
+    gchar *source = g_strdup(pattern);
+    GRegex *regex = g_regex_new(source, flags, 0, NULL);
+    if (regex == NULL) {
+        g_free(source);
+        source = g_regex_escape_string(pattern, -1);
+        regex = g_regex_new(source, flags, 0, NULL);
+    }
+    if (regex == NULL) {
+        g_free(source);
+        return;
+    }
+    /* VTE selects the shown match with the same pattern */
+    VteRegex *vteRegex = vte_regex_new_for_search(source, -1, vteFlags, NULL);
+    g_free(source);
+    Search *search = g_new0(Search, 1);
+    search->refCount = 1;
+    search->regex = regex;
+    search->vteRegex = vteRegex;
+    search->cancellable = g_cancellable_new();
+    search->matches = g_array_new(FALSE, FALSE, sizeof(glong));
+    search->current = -1;
+    search->termWindow = termWindow;
+    search->terminal = terminal;
+    g_object_add_weak_pointer(G_OBJECT(terminal), (gpointer *)&search->terminal);
+    vte_terminal_search_set_regex(VTE_TERMINAL(terminal), vteRegex, 0);
+    termWindow->search = search;
+    SearchIndex *index = g_object_get_data(G_OBJECT(terminal), TERM_DATA_SEARCH);
+    if (index == NULL) {
+        index = g_new0(SearchIndex, 1);
+        index->blocks = g_ptr_array_new_with_free_func(unrefSearchBlock);
+        g_object_set_data_full(G_OBJECT(terminal), TERM_DATA_SEARCH, index, freeSearchIndex);
+    }
+    GtkAdjustment *adjustment = gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(terminal));
+    glong lowerRow = (glong)gtk_adjustment_get_lower(adjustment);
+    glong upperRow = (glong)gtk_adjustment_get_upper(adjustment);
+    /* Visible rows might still change, they are not indexed */
+    glong screenRow = MAX(lowerRow, upperRow - vte_terminal_get_row_count(VTE_TERMINAL(terminal)));
+    SearchBlock *screen = readSearchBlock(terminal, screenRow, upperRow);
+    queueSearchBlock(search, screen);
+    unrefSearchBlock(screen);
+    /* Rows are numbered again after a rewrap to another width */
+    glong columns = vte_terminal_get_column_count(VTE_TERMINAL(terminal));
+    if (index->columns != columns || index->end > screenRow)
+        g_ptr_array_set_size(index->blocks, 0);
+    index->columns = columns;
+    /* Drop the blocks that are removed from the scrollback */
+    while (index->blocks->len > 0) {
+        SearchBlock *block = g_ptr_array_index(index->blocks, 0);
+        if (block->row + (glong)block->offsets->len > lowerRow)
+            break;
+        g_ptr_array_remove_index(index->blocks, 0);
+    }
+    /* Reindex from the first block that is changed by a reset or clear */
+    for (guint i = 0; i < index->blocks->len; i++) {
+        SearchBlock *block = g_ptr_array_index(index->blocks, i);
+        if (block->row < lowerRow || checkSearchBlock(terminal, block))
+            continue;
+        index->end = block->row;
+        g_ptr_array_set_size(index->blocks, i);
+        break;
+    }
+    if (index->blocks->len == 0)
+        index->end = lowerRow;
+    index->end = MAX(index->end, lowerRow);
+    search->indexStart = lowerRow;
+    for (int i = index->blocks->len - 1; i >= 0; i--)
+        queueSearchBlock(search, g_ptr_array_index(index->blocks, i));
+    search->indexEnd = screenRow;
+    if (index->end < search->indexEnd)
+        search->indexSource = g_idle_add(searchOnIndex, search);
+    updateSearchLabel(termWindow);
+}
+
+/*!
+ * Restart the search after typing.
+ *
+ * \param userData (TermWindow)
+ * \return FALSE for removing the source
+ */
+static gboolean searchOnDelay(gpointer userData) {
+    TermWindow *termWindow = userData;
+    termWindow->searchSource = 0;
+    startSearch(termWindow, gtk_entry_get_text(GTK_ENTRY(termWindow->searchEntry)));
+    return G_SOURCE_REMOVE;
+}
+
+/*!
+ * Handle the changes of the search entry.
+ *
+ * \param entry
+ * \param userData (TermWindow)
+ */
+static void searchOnChanged(GtkEditable *entry, gpointer userData) {
+    TermWindow *termWindow = userData;
+    UNUSED(entry);
+    if (termWindow->searchSource != 0)
+        g_source_remove(termWindow->searchSource);
+    termWindow->searchSource = g_timeout_add(TERM_SEARCH_DELAY, searchOnDelay, termWindow);
+}
+
+/*!
+ * Hide the search bar and focus the terminal.
+ *
+ * \param termWindow
+ */
+static void hideSearch(TermWindow *termWindow) {
+    if (termWindow->searchSource != 0) {
+        g_source_remove(termWindow->searchSource);
+        termWindow->searchSource = 0;
+    }
+    GtkNotebook *notebook = GTK_NOTEBOOK(termWindow->notebook);
+    GtkWidget *terminal = getPageTerm(gtk_notebook_get_nth_page(notebook,
+                                      gtk_notebook_get_current_page(notebook)));
+    cancelSearch(termWindow);
+    if (terminal != NULL)
+        gtk_widget_grab_focus(terminal);
+    if (termWindow->searchBar != NULL)
+        gtk_widget_hide(termWindow->searchBar);
+}
+
+/*!
+ * Handle the key presses of the search entry.
+ *
+ * Return goes to the previous (older) match, Shift+Return to the next
+ * one and Escape closes the search bar.
+ *
+ * \param entry
+ * \param event
+ * \param userData (TermWindow)
+ * \return TRUE if the key is handled
+ */
+static gboolean searchOnKeyPress(GtkWidget *entry, GdkEventKey *event, gpointer userData) {
+    TermWindow *termWindow = userData;
+    Search *search = termWindow->search;
+    UNUSED(entry);
+    if (event->keyval == GDK_KEY_Escape) {
+        hideSearch(termWindow);
+        return TRUE;
+    }
+    if (event->keyval != GDK_KEY_Return)
+        return FALSE;
+    /* Run the pending search first */
+    if (termWindow->searchSource != 0) {
+        g_source_remove(termWindow->searchSource);
+        searchOnDelay(termWindow);
+        return TRUE;
+    }
+    if (search == NULL || search->matches->len == 0)
+        return TRUE;
+    if (event->state & GDK_SHIFT_MASK)
+        search->current = MIN(search->current + 1, (int)search->matches->len - 1);
+    else
+        search->current = MAX(search->current - 1, 0);
+    showSearchMatch(search);
+    return TRUE;
+}
+
+/*!
+ * Show the search bar of the window.
+ *
+ * \param termWindow
+ */
+static void showSearch(TermWindow *termWindow) {
+    createBars(termWindow);
+    gtk_widget_show_all(termWindow->searchBar);
+    gtk_widget_grab_focus(termWindow->searchEntry);
+    /* Search again for the new output */
+    if (*gtk_entry_get_text(GTK_ENTRY(termWindow->searchEntry)))
+        searchOnChanged(GTK_EDITABLE(termWindow->searchEntry), termWindow);
+}
+
+/*!
+ * Free the streaming paste.
+ *
+ * \param data (Paste)
+ */
+static void freePaste(gpointer data) {
+    Paste *paste = data;
+    if (paste->terminal != NULL)
+        g_object_remove_weak_pointer(G_OBJECT(paste->terminal),
+                                     (gpointer *)&paste->terminal);
+    if (paste->watch != 0)
+        g_source_remove(paste->watch);
+    g_free(paste->data);
+    g_free(paste);
+}
+
+/*!
+ * Stop the streaming paste of the window.
+ *
+ * The bracketed paste is closed if it was started.
+ *
+ * \param termWindow
+ */
+static void stopPaste(TermWindow *termWindow) {
+    Paste *paste = termWindow->paste;
+    if (paste == NULL)
+        return;
+    termWindow->paste = NULL;
+    if (pasteBracketed && paste->offset > 0 &&
+        paste->offset <= paste->size - strlen(TERM_PASTE_END) && paste->terminal != NULL) {
+        VtePty *pty = vte_terminal_get_pty(VTE_TERMINAL(paste->terminal));
+        if (pty != NULL && write(vte_pty_get_fd(pty), TERM_PASTE_END,
+                                 strlen(TERM_PASTE_END)) == -1)
+            printLog("paste end not written\n");
+        queueBroadcast(paste->terminal, TERM_PASTE_END, strlen(TERM_PASTE_END));
+    }
+    gtk_widget_hide(termWindow->pasteBar);
+    freePaste(paste);
+}
+
+/*!
+ * Show the progress of the streaming paste.
+ *
+ * \param termWindow
+ */
+static void updatePasteBar(TermWindow *termWindow) {
+    Paste *paste = termWindow->paste;
+    gchar *done = g_format_size(paste->offset);
+    gchar *total = g_format_size(paste->size);
+    gchar *text = g_strdup_printf("Pasting %s of %s", done, total);
+    gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(termWindow->pasteBar),
+                                  (gdouble)paste->offset / paste->size);
+    gtk_progress_bar_set_text(GTK_PROGRESS_BAR(termWindow->pasteBar), text);
+    g_free(text);
+    g_free(total);
+    g_free(done);
+}
+
+/*!
+ * Write the next chunk of the paste when the PTY is writable.
+ *
+ * \param fd
+ * \param condition
+ * \param userData (TermWindow)
+ * \return TRUE until the paste is written
+ */
+static gboolean pasteOnWritable(gint fd, GIOCondition condition, gpointer userData) {
+    UNUSED(condition);
+    TermWindow *termWindow = userData;
+    Paste *paste = termWindow->paste;
+    /* Terminal is destroyed */
+    if (paste->terminal == NULL) {
+        paste->watch = 0;
+        stopPaste(termWindow);
+        return G_SOURCE_REMOVE;
+    }
+    /* Wait for the broadcast terminals to read the written chunks */
+    gsize space = getBroadcastSpace(paste->terminal);
+    if (space == 0) {
+        paste->watch = g_timeout_add(TERM_PASTE_WAIT, pasteOnWait, termWindow);
+        return G_SOURCE_REMOVE;
+    }
+    ssize_t written = write(fd, paste->data + paste->offset,
+                            MIN(MIN(paste->size - paste->offset, TERM_PASTE_CHUNK), space));
+    if (written > 0) {
+        queueBroadcast(paste->terminal, paste->data + paste->offset, written);
+        paste->offset += written;
+    }
+    if ((written == -1 && errno != EAGAIN && errno != EINTR) ||
+        paste->offset == paste->size) {
+        paste->watch = 0;
+        stopPaste(termWindow);
+        return G_SOURCE_REMOVE;
+    }
+    updatePasteBar(termWindow);
+    return G_SOURCE_CONTINUE;
+}
+
+/*!
+ * Continue the paste after the broadcast terminals have read the input.
+ *
+ * \param userData (TermWindow)
+ * \return FALSE for removing the source
+ */
+static gboolean pasteOnWait(gpointer userData) {
+    TermWindow *termWindow = userData;
+    Paste *paste = termWindow->paste;
+    VtePty *pty = paste->terminal != NULL ?
+        vte_terminal_get_pty(VTE_TERMINAL(paste->terminal)) : NULL;
+    if (pty == NULL) {
+        paste->watch = 0;
+        stopPaste(termWindow);
+        return G_SOURCE_REMOVE;
+    }
+    paste->watch = g_unix_fd_add(vte_pty_get_fd(pty), G_IO_OUT, pasteOnWritable, termWindow);
+    return G_SOURCE_REMOVE;
+}
+
+/*!
+ * Start writing the paste to the PTY of its terminal.
+ *
+ * \param paste
+ */
+static void startPaste(Paste *paste) {
+    TermWindow *termWindow = paste->terminal != NULL ? getTermWindow(paste->terminal) : NULL;
+    VtePty *pty = paste->terminal != NULL ?
+        vte_terminal_get_pty(VTE_TERMINAL(paste->terminal)) : NULL;
+    if (termWindow == NULL || pty == NULL) {
+        freePaste(paste);
+        return;
+    }
+    stopPaste(termWindow);
+    createBars(termWindow);
+    termWindow->paste = paste;
+    paste->watch = g_unix_fd_add(vte_pty_get_fd(pty), G_IO_OUT, pasteOnWritable, termWindow);
+    updatePasteBar(termWindow);
+    gtk_widget_show(termWindow->pasteBar);
+    printLog("paste: %" G_GSIZE_FORMAT " bytes\n", paste->size);
+}
+
+/*!
+ * Start the paste if it is confirmed.
+ *
+ * \param dialog
+ * \param response
+ * \param userData
+ */
+static void pasteOnConfirm(GtkDialog *dialog, gint response, gpointer userData) {
+    UNUSED(userData);
+    Paste *paste = g_object_steal_data(G_OBJECT(dialog), TERM_DATA_PASTE);
+    gtk_widget_destroy(GTK_WIDGET(dialog));
+    if (paste == NULL)
+        return;
+    if (response == GTK_RESPONSE_OK)
+        startPaste(paste);
+    else
+        freePaste(paste);
+}
+
+/*!
+ * Paste the text of the clipboard.
+ *
+ * Small pastes are handled by VTE. Larger ones are converted like
+ * VTE does (newlines to carriage returns) and streamed to the PTY in
+ * chunks, after a confirmation above the paste_confirm size.
+ *
+ * \param clipboard
+ * \param text
+ * \param userData (Paste)
+ */
+static void pasteOnText(GtkClipboard *clipboard, const gchar *text, gpointer userData) {
+    UNUSED(clipboard);
+    Paste *paste = userData;
+    gsize size = text != NULL ? strlen(text) : 0;
+    if (paste->terminal == NULL || size == 0) {
+        freePaste(paste);
+        return;
+    }
+    /* Text is already received, VTE brackets it in the mode of the terminal */
+    if (size < TERM_PASTE_STREAM) {
+#if VTE_CHECK_VERSION(0, 68, 0)
+        vte_terminal_paste_text(VTE_TERMINAL(paste->terminal), text);
+#else
+        vte_terminal_paste_clipboard(VTE_TERMINAL(paste->terminal));
+#endif
+        freePaste(paste);
+        return;
+    }
+    GByteArray *data = g_byte_array_sized_new(size + 2 * strlen(TERM_PASTE_START));
+    if (pasteBracketed)
+        g_byte_array_append(data, (const guint8 *)TERM_PASTE_START, strlen(TERM_PASTE_START));
+    for (gsize i = 0; i < size; i++) {
+        if (text[i] == '\n' && i > 0 && text[i - 1] == '\r')
+            continue;
+        guint8 c = text[i] == '\n' ? '\r' : text[i];
+        g_byte_array_append(data, &c, 1);
+    }
+    if (pasteBracketed)
+        g_byte_array_append(data, (const guint8 *)TERM_PASTE_END, strlen(TERM_PASTE_END));
+    paste->size = data->len;
+    paste->data = (char *)g_byte_array_free(data, FALSE);
+    if (pasteConfirm <= 0 || size < pasteConfirm) {
+        startPaste(paste);
+        return;
+    }
+    gchar *total = g_format_size(size);
+    GtkWidget *dialog = gtk_message_dialog_new(
+        GTK_WINDOW(gtk_widget_get_toplevel(paste->terminal)),
+        GTK_DIALOG_MODAL | GTK_DIALOG_DESTROY_WITH_PARENT, GTK_MESSAGE_QUESTION,
+        GTK_BUTTONS_OK_CANCEL, "Paste %s of text?", total);
+    g_free(total);
+    g_object_set_data_full(G_OBJECT(dialog), TERM_DATA_PASTE, paste, freePaste);
+    g_signal_connect(dialog, "response", G_CALLBACK(pasteOnConfirm), NULL);
+    gtk_widget_show(dialog);
+}
+
+/*!
+ * Create the search bar and the paste progress of the window.
+ *
+ * They are hidden until used, so they are not needed for the
+ * first frame of the window.
+ *
+ * \param termWindow
+ */
+static void createBars(TermWindow *termWindow) {
+    if (termWindow->searchBar != NULL)
+        return;
+    if (termWindow->barsSource != 0) {
+        g_source_remove(termWindow->barsSource);
+        termWindow->barsSource = 0;
+    }
+    /* Create the search bar (hidden until the search action) */
+    termWindow->searchBar = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 0);
+    termWindow->searchEntry = gtk_entry_new();
+    termWindow->searchLabel = gtk_label_new(NULL);
+    gtk_box_pack_start(GTK_BOX(termWindow->searchBar), termWindow->searchEntry, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(termWindow->searchBar), termWindow->searchLabel, FALSE, FALSE, 0);
+    gtk_widget_set_no_show_all(termWindow->searchBar, TRUE);
+    g_signal_connect(termWindow->searchEntry, "changed", G_CALLBACK(searchOnChanged), termWindow);
+    g_signal_connect(termWindow->searchEntry, "key-press-event",
+                     G_CALLBACK(searchOnKeyPress), termWindow);
+    /* Create the paste progress (shown while streaming) */
+    termWindow->pasteBar = gtk_progress_bar_new();
+    gtk_progress_bar_set_show_text(GTK_PROGRESS_BAR(termWindow->pasteBar), TRUE);
+    gtk_widget_set_no_show_all(termWindow->pasteBar, TRUE);
+    /* Paste progress and search bar go below the paned */
+    gtk_box_pack_start(GTK_BOX(termWindow->box), termWindow->pasteBar, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(termWindow->box), termWindow->searchBar, FALSE, FALSE, 0);
+}
+
+/*!
+ * Create the bars of the window when the main loop is idle.
+ *
+ * \param userData (TermWindow)
+ * \return FALSE for removing the source
+ */
+static gboolean termWindowOnBars(gpointer userData) {
+    TermWindow *termWindow = userData;
+    termWindow->barsSource = 0;
+    createBars(termWindow);
+    markStartup("bars");
+    return G_SOURCE_REMOVE;
+}
+
+/*!
+ * Create a new terminal window without tabs.
+ *
+ * \param cmd (command to execute in the tabs)
+ * \param title (title to set in window)
+ * \return window
+ */
+static TermWindow *createWindow(const char *cmd, const char *title) {
+    TermWindow *termWindow = g_new0(TermWindow, 1);
+    termWindow->title = g_strdup(title);
+    termWindow->command = g_strdup(cmd);
+    /* Create & configure the window widget */
+    GtkWidget *window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
+    termWindow->window = window;
+    g_object_set_data(G_OBJECT(window), TERM_NAME, termWindow);
+    if (title == NULL)
+        gtk_window_set_title(GTK_WINDOW(window), TERM_NAME);
+    else
+        gtk_window_set_title(GTK_WINDOW(window), title);
+    setWindowVisual(window);
+    gtk_widget_override_background_color(window, GTK_STATE_FLAG_NORMAL,
+                                         &theme.background);
+    /* Create & configure the paned widget */
+    GtkWidget *paned = gtk_paned_new(GTK_ORIENTATION_VERTICAL);
+    termWindow->paned = paned;
+    gtk_paned_set_wide_handle(GTK_PANED(paned), FALSE);
+    /* Create & configure the notebook widget */
+    GtkWidget *notebook = gtk_notebook_new();
+    termWindow->notebook = notebook;
+    gtk_notebook_set_tab_pos(GTK_NOTEBOOK(notebook), GTK_POS_BOTTOM);
+    gtk_notebook_set_scrollable(GTK_NOTEBOOK(notebook), TRUE);
+    gtk_notebook_popup_disable(GTK_NOTEBOOK(notebook));
+    gtk_notebook_set_show_tabs(GTK_NOTEBOOK(notebook), FALSE);
+    gtk_notebook_set_show_border(GTK_NOTEBOOK(notebook), FALSE);
+    /* Connect signals of window and notebook for tab feature */
+    g_signal_connect(window, "destroy", G_CALLBACK(termWindowOnDestroy), termWindow);
+    g_signal_connect(window, "focus-in-event", G_CALLBACK(termWindowOnFocus), termWindow);
+    g_signal_connect(window, "size-allocate", G_CALLBACK(termOnResize), termWindow);
+    g_signal_connect(notebook, "page-added", G_CALLBACK(termTabOnAdd), NULL);
+    g_signal_connect(notebook, "switch-page", G_CALLBACK(termTabOnSwitch), termWindow);
+    g_signal_connect(notebook, "page-removed", G_CALLBACK(termTabOnRemove), NULL);
+    /* Add notebook to paned */
+    if (tabPosition == 0)
+        gtk_paned_add1(GTK_PANED(paned), notebook);
+    else
+        gtk_paned_add2(GTK_PANED(paned), notebook);
+    /* Add paned to the box of the bars, which are created on idle */
+    termWindow->box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
+    gtk_box_pack_start(GTK_BOX(termWindow->box), paned, TRUE, TRUE, 0);
+    gtk_container_add(GTK_CONTAINER(window), termWindow->box);
+    termWindow->barsSource = g_idle_add_full(G_PRIORITY_LOW, termWindowOnBars,
+                                             termWindow, NULL);
+    if (startupMarks != NULL)
+        g_signal_connect_after(window, "draw", G_CALLBACK(startupOnDraw), NULL);
+    g_ptr_array_add(termWindows, termWindow);
+    lastWindow = termWindow;
+    return termWindow;
+}
+
+/*!
+ * Create a new terminal window with a single tab.
+ *
+ * \param dir (working directory of the first tab)
+ * \param cmd (command to execute in the tabs)
+ * \param title (title to set in window)
+ * \return window
+ */
+static TermWindow *newWindow(const char *dir, const char *cmd,
+                             const char *title) {
+    /* Shell starts while the window is created */
+    GtkWidget *terminal = takeTerm(dir, cmd);
+    TermWindow *termWindow = createWindow(cmd, title);
+    /* Add terminal to notebook as first tab */
+    gtk_notebook_append_page(GTK_NOTEBOOK(termWindow->notebook), terminal, NULL);
+    g_object_unref(terminal);
+    /* Show all widgets with childs */
+    gtk_widget_show_all(termWindow->window);
+    markStartup("window");
+    return termWindow;
+}
+
+/*!
+ * Connect to the single-instance server socket.
+ *
+ * \return socket (-1 if the server is not running)
+ */
+static int connectServer() {
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if (strlen(socketPath) >= sizeof(address.sun_path))
+        return -1;
+    strcpy(address.sun_path, socketPath);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*!
+ * Send the window/tab request to the running server.
+ *
+ * \return 0 if the server handled the request
+ */
+static int sendRequest() {
+    char reply[TERM_CONFIG_LENGTH] = {0};
+    int fd = connectServer();
+    if (fd == -1)
+        return -1;
+    gchar *cwd = workingDir ? g_strdup(workingDir) : g_get_current_dir();
+    GString *request = g_string_new(tabRequest ? "new-tab\n" : "new-window\n");
+    gchar *value = g_strescape(cwd, NULL);
+    g_string_append_printf(request, "cwd %s\n", value);
+    g_free(value);
+    if (backgroundRequest)
+        g_string_append(request, "background 1\n");
+    if (termCommand != NULL) {
+        value = g_strescape(termCommand, NULL);
+        g_string_append_printf(request, "command %s\n", value);
+        g_free(value);
+    }
+    if (termTitle != NULL) {
+        value = g_strescape(termTitle, NULL);
+        g_string_append_printf(request, "title %s\n", value);
+        g_free(value);
+    }
+    /* Send the request and wait for the reply */
+    if (write(fd, request->str, request->len) == (ssize_t)request->len) {
+        shutdown(fd, SHUT_WR);
+        if (read(fd, reply, sizeof(reply) - 1) == -1)
+            reply[0] = 0;
+    }
+    close(fd);
+    g_string_free(request, TRUE);
+    g_free(cwd);
+    printLog("server reply: %s", reply);
+    return strncmp(reply, "ok", 2) == 0 ? 0 : -1;
+}
+
+/*!
+ * Print the resource report of the running server.
+ *
+ * \return 0 on success
+ */
+static int requestStats() {
+    char buf[TERM_BUFFER_SIZE];
+    ssize_t len;
+    int fd = connectServer();
+    if (fd == -1) {
+        fprintf(stderr, "%s server is not running (%s)\n", TERM_NAME, socketPath);
+        return 1;
+    }
+    GString *reply = g_string_new(NULL);
+    if (write(fd, "stats\n", 6) == 6) {
+        shutdown(fd, SHUT_WR);
+        while ((len = read(fd, buf, sizeof(buf))) > 0)
+            g_string_append_len(reply, buf, len);
+    }
+    close(fd);
+    int result = strncmp(reply->str, "ok\n", 3) != 0;
+    if (result)
+        fprintf(stderr, "Unable to get the stats: %s", reply->str);
+    else
+        fputs(reply->str + 3, stdout);
+    g_string_free(reply, TRUE);
+    return result;
+}
+
+/*!
+ * Handle a request on the server socket.
+ *
+ * \param request
+ * \param reply
+ */
+static void handleRequest(char *request, GString *reply) {
+    char *cwd = NULL, *cmd = NULL, *title = NULL;
+    gboolean background = FALSE;
+    gchar **lines = g_strsplit(request, "\n", -1);
+    for (int i = 1; lines[0] != NULL && lines[i] != NULL; i++) {
+        char *value = strchr(lines[i], ' ');
+        if (value == NULL)
+            continue;
+        *value++ = 0;
+        if (!strcmp(lines[i], "cwd"))
+            cwd = g_strcompress(value);
+        else if (!strcmp(lines[i], "command"))
+            cmd = g_strcompress(value);
+        else if (!strcmp(lines[i], "title"))
+            title = g_strcompress(value);
+        else if (!strcmp(lines[i], "background"))
+            background = atoi(value) != 0;
+    }
+    g_string_assign(reply, "ok\n");
+    if (lines[0] == NULL) {
+        g_string_assign(reply, "error empty request\n");
+    } else if (!strcmp(lines[0], "stats")) {
+        GString *report = getReport();
+        g_string_append_len(reply, report->str, report->len);
+        g_string_free(report, TRUE);
+    } else if (!strcmp(lines[0], "new-tab") && lastWindow != NULL && background) {
+        appendBackgroundTab(lastWindow, cwd, cmd);
+    } else if (!strcmp(lines[0], "new-tab") && lastWindow != NULL) {
+        appendTab(lastWindow, cwd, cmd);
+        gtk_window_present(GTK_WINDOW(lastWindow->window));
+    } else if (!strcmp(lines[0], "new-tab") || !strcmp(lines[0], "new-window")) {
+        newWindow(cwd, cmd, title);
+    } else {
+        g_string_assign(reply, "error unknown request\n");
+    }
+    printLog("request: %s -> %.*s\n", lines[0] ?: "", (int)strcspn(reply->str, "\n"),
+             reply->str);
+    g_strfreev(lines);
+    g_free(cwd);
+    g_free(cmd);
+    g_free(title);
+}
+
+/*!
+ * Close the client of the server socket.
+ *
+ * \param client
+ */
+static void freeClient(Client *client) {
+    if (client->watch != 0)
+        g_source_remove(client->watch);
+    if (client->timeout != 0)
+        g_source_remove(client->timeout);
+    close(client->fd);
+    g_string_free(client->request, TRUE);
+    if (client->reply != NULL)
+        g_string_free(client->reply, TRUE);
+    g_free(client);
+}
+
+/*!
+ * Drop the client that doesn't finish its request in time.
+ *
+ * \param userData (Client)
+ * \return FALSE for removing the source
+ */
+static gboolean clientOnTimeout(gpointer userData) {
+    Client *client = userData;
+    client->timeout = 0;
+    printLog("request timed out\n");
+    freeClient(client);
+    return G_SOURCE_REMOVE;
+}
+
+/*!
+ * Write the reply to the client when its socket is writable.
+ *
+ * \param fd
+ * \param condition
+ * \param userData (Client)
+ * \return TRUE until the reply is written
+ */
+static gboolean clientOnWritable(gint fd, GIOCondition condition, gpointer userData) {
+    UNUSED(condition);
+    Client *client = userData;
+    ssize_t len = write(fd, client->reply->str + client->offset,
+                        client->reply->len - client->offset);
+    if (len > 0)
+        client->offset += len;
+    if (client->offset < client->reply->len &&
+        (len > 0 || errno == EAGAIN || errno == EINTR))
+        return G_SOURCE_CONTINUE;
+    if (client->offset < client->reply->len)
+        printLog("Unable to reply to the client\n");
+    client->watch = 0;
+    freeClient(client);
+    return G_SOURCE_REMOVE;
+}
+
+/*!
+ * Read the request of the client when its socket is readable.
+ *
+ * The request is complete when the client shuts down its side of
+ * the socket, a client that sends it slowly never blocks the main loop.
+ *
+ * \param fd
+ * \param condition
+ * \param userData (Client)
+ * \return TRUE until the request is read
+ */
+static gboolean clientOnReadable(gint fd, GIOCondition condition, gpointer userData) {
+    UNUSED(condition);
+    Client *client = userData;
+    char buf[TERM_BUFFER_SIZE];
+    ssize_t len;
+    while (client->request->len < TERM_REQUEST_MAX &&
+           (len = read(fd, buf, MIN(sizeof(buf),
+                                    TERM_REQUEST_MAX - client->request->len))) > 0)
+        g_string_append_len(client->request, buf, len);
+    if (client->request->len < TERM_REQUEST_MAX && len == -1 &&
+        (errno == EAGAIN || errno == EINTR))
+        return G_SOURCE_CONTINUE;
+    client->watch = 0;
+    if (len == -1 && client->request->len < TERM_REQUEST_MAX) {
+        freeClient(client);
+        return G_SOURCE_REMOVE;
+    }
+    client->reply = g_string_new(NULL);
+    handleRequest(client->request->str, client->reply);
+    client->watch = g_unix_fd_add(fd, G_IO_OUT, clientOnWritable, client);
+    return G_SOURCE_REMOVE;
+}
+
+/*!
+ * Accept a client on the server socket.
+ *
+ * \param fd
+ * \param condition
+ * \param userData
+ * \return TRUE for keeping the source
+ */
+static gboolean serverOnRequest(gint fd, GIOCondition condition,
+                                gpointer userData) {
+    UNUSED(condition);
+    UNUSED(userData);
+    int clientFd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (clientFd == -1)
+        return G_SOURCE_CONTINUE;
+    Client *client = g_new0(Client, 1);
+    client->fd = clientFd;
+    client->request = g_string_new(NULL);
+    client->watch = g_unix_fd_add(clientFd, G_IO_IN, clientOnReadable, client);
+    /* Don't let a stuck client keep its socket open */
+    client->timeout = g_timeout_add_seconds(TERM_REQUEST_TIMEOUT, clientOnTimeout, client);
+    return G_SOURCE_CONTINUE;
+}
+
+/*!
+ * Start listening on the single-instance server socket.
+ *
+ * \return 0 on success
+ */
+static int startServer() {
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    int fd = connectServer();
+    if (fd != -1) {
+        close(fd);
+        fprintf(stderr, "%s server is already running (%s)\n",
+                TERM_NAME, socketPath);
+        return 1;
+    }
+    if (strlen(socketPath) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path is too long (%s)\n", socketPath);
+        return 1;
+    }
+    strcpy(address.sun_path, socketPath);
+    /* Remove the stale socket of a server that is not running */
+    unlink(socketPath);
+    serverSocket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (serverSocket == -1 ||
+        bind(serverSocket, (struct sockaddr *)&address, sizeof(address)) == -1 ||
+        listen(serverSocket, TERM_CONFIG_LENGTH) == -1) {
+        perror("Unable to start the server");
+        return 1;
+    }
+    g_unix_fd_add(serverSocket, G_IO_IN, serverOnRequest, NULL);
+    printLog("server: %s\n", socketPath);
+    return 0;
+}
+
+/*!
+ * Append a 32-bit little-endian value to the snapshot.
+ *
+ * \param data
+ * \param value
+ */
+static void appendU32(GByteArray *data, guint32 value) {
+    value = GUINT32_TO_LE(value);
+    g_byte_array_append(data, (const guint8 *)&value, sizeof(value));
+}
+
+/*!
+ * Append a length-prefixed block to the snapshot.
+ *
+ * \param data
+ * \param block (NULL for an empty block)
+ * \param size
+ */
+static void appendBlock(GByteArray *data, gconstpointer block, gsize size) {
+    appendU32(data, block != NULL ? size : 0);
+    if (block != NULL)
+        g_byte_array_append(data, block, size);
+}
+
+/*!
+ * Append a string to the snapshot.
+ *
+ * \param data
+ * \param value (NULL for an empty string)
+ */
+static void appendString(GByteArray *data, const char *value) {
+    appendBlock(data, value, value != NULL ? strlen(value) : 0);
+}
+
+/*!
+ * Get the first terminal of the notebook page.
+ *
+ * \param page
+ * \return terminal (NULL if the page has no terminal)
+ */
+static GtkWidget *getPageTerm(GtkWidget *page) {
+    if (VTE_IS_TERMINAL(page))
+        return page;
+    GtkWidget *terminal = NULL;
+    if (GTK_IS_CONTAINER(page)) {
+        GList *children = gtk_container_get_children(GTK_CONTAINER(page));
+        for (GList *child = children; child != NULL && terminal == NULL; child = child->next)
+            terminal = getPageTerm(child->data);
+        g_list_free(children);
+    }
+    return terminal;
+}
+
+/*!
+ * Free the session snapshot.
+ *
+ * \param snapshot
+ */
+static void freeSessionSnapshot(SessionSnapshot *snapshot) {
+    if (snapshot->data != NULL)
+        g_byte_array_free(snapshot->data, TRUE);
+    g_ptr_array_unref(snapshot->parts);
+    g_ptr_array_unref(snapshot->terminals);
+    if (snapshot->texts != NULL)
+        g_ptr_array_unref(snapshot->texts);
+    g_free(snapshot);
+}
+
+/*!
+ * End the literal run of the snapshot.
+ *
+ * \param snapshot
+ */
+static void flushSessionSnapshot(SessionSnapshot *snapshot) {
+    g_ptr_array_add(snapshot->parts, g_byte_array_free_to_bytes(snapshot->data));
+    snapshot->data = g_byte_array_new();
+}
+
+/*!
+ * Append the lazy pane to the session snapshot.
+ *
+ * \param data
+ * \param lazyPane
+ */
+static void snapshotLazyPane(GByteArray *data, LazyPane *lazyPane) {
+    appendString(data, lazyPane->dir);
+    appendString(data, lazyPane->title);
+    appendString(data, lazyPane->command);
+    appendU32(data, lazyPane->scrollbackSize);
+    if (lazyPane->scrollback != NULL)
+        appendBlock(data, g_bytes_get_data(lazyPane->scrollback, NULL),
+                    g_bytes_get_size(lazyPane->scrollback));
+    else
+        appendBlock(data, NULL, 0);
+}
+
+/*!
+ * Append the terminal to the session snapshot.
+ *
+ * The scrollback is only a placeholder, it is read if the snapshot
+ * is changed and compressed in the writer thread.
+ *
+ * \param snapshot
+ * \param terminal
+ */
+static void snapshotPane(SessionSnapshot *snapshot, GtkWidget *terminal) {
+    gchar *dir = getTermDir(terminal);
+    appendString(snapshot->data, dir);
+    appendString(snapshot->data, vte_terminal_get_window_title(VTE_TERMINAL(terminal)));
+    appendString(snapshot->data, g_object_get_data(G_OBJECT(terminal), TERM_DATA_COMMAND));
+    g_free(dir);
+    if (sessionLines > 0) {
+        g_ptr_array_add(snapshot->terminals, g_object_ref(terminal));
+        flushSessionSnapshot(snapshot);
+    } else {
+        appendU32(snapshot->data, 0);
+        appendBlock(snapshot->data, NULL, 0);
+    }
+}
+
+/*!
+ * Read the scrollback of the terminal for the session.
+ *
+ * \param terminal
+ * \return text (NULL if it is not available)
+ */
+static GBytes *getSessionText(GtkWidget *terminal) {
+    GtkAdjustment *adjustment = gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(terminal));
+    glong end = (glong)gtk_adjustment_get_upper(adjustment);
+    glong start = MAX((glong)gtk_adjustment_get_lower(adjustment), end - sessionLines);
+    gchar *text = vte_terminal_get_text_range(
+        VTE_TERMINAL(terminal), start, 0, end - 1,
+        vte_terminal_get_column_count(VTE_TERMINAL(terminal)) - 1, NULL, NULL, NULL);
+    return text != NULL ? g_bytes_new_take(text, strlen(text)) : NULL;
+}
+
+/*!
+ * Append the notebook page to the session snapshot.
+ *
+ * \param snapshot
+ * \param window (index of the window)
+ * \param active
+ * \param page
+ */
+static void snapshotTab(SessionSnapshot *snapshot, guint32 window, gboolean active,
+                        GtkWidget *page) {
+    GByteArray *data = snapshot->data;
+    LazyTab *lazyTab = g_object_get_data(G_OBJECT(page), TERM_DATA_LAZY);
+    /* Not spawned yet, keep the restored state */
+    if (lazyTab != NULL) {
+        appendU32(data, window);
+        appendU32(data, active ? TERM_SESSION_ACTIVE : 0);
+        appendString(data, lazyTab->layout);
+        appendU32(data, lazyTab->panes->len);
+        for (int i = 0; i < lazyTab->panes->len; i++)
+            snapshotLazyPane(data, g_ptr_array_index(lazyTab->panes, i));
+        snapshot->tabCount++;
+        return;
+    }
+    GString *layout = g_string_new(NULL);
+    GPtrArray *terminals = g_ptr_array_new();
+    getLayout(page, layout, terminals);
+    if (terminals->len > 0) {
+        appendU32(data, window);
+        appendU32(data, active ? TERM_SESSION_ACTIVE : 0);
+        appendString(data, terminals->len > 1 ? layout->str : NULL);
+        appendU32(data, terminals->len);
+        for (int i = 0; i < terminals->len; i++)
+            snapshotPane(snapshot, g_ptr_array_index(terminals, i));
+        snapshot->tabCount++;
+    }
+    g_ptr_array_free(terminals, TRUE);
+    g_string_free(layout, TRUE);
+}
+
+/*!
+ * Write the session snapshot to the session file (writer thread).
+ *
+ * Snapshots are framed with their size on both ends, so the last
+ * complete one can be found from the end of the file. The file is
+ * rewritten with only the last snapshot when it gets too large.
+ *
+ * \param snapshot
+ */
+static void writeSession(SessionSnapshot *snapshot) {
+    GByteArray *payload = g_byte_array_new();
+    appendU32(payload, TERM_SESSION_VERSION);
+    appendU32(payload, snapshot->tabCount);
+    for (int i = 0; i < snapshot->parts->len; i++) {
+        gsize size;
+        gconstpointer part = g_bytes_get_data(g_ptr_array_index(snapshot->parts, i), &size);
+        g_byte_array_append(payload, part, size);
+        if (i >= snapshot->texts->len)
+            continue;
+        /* Scrollback that follows the literal run */
+        GBytes *text = g_ptr_array_index(snapshot->texts, i);
+        GBytes *scrollback = NULL;
+        if (text != NULL) {
+            GConverter *compressor = G_CONVERTER(
+                g_zlib_compressor_new(G_ZLIB_COMPRESSOR_FORMAT_RAW, -1));
+            scrollback = convertBytes(compressor, text, g_bytes_get_size(text) / 4);
+            g_object_unref(compressor);
+        }
+        appendU32(payload, scrollback != NULL ? g_bytes_get_size(text) : 0);
+        if (scrollback != NULL) {
+            appendBlock(payload, g_bytes_get_data(scrollback, NULL),
+                        g_bytes_get_size(scrollback));
+            g_bytes_unref(scrollback);
+        } else {
+            appendBlock(payload, NULL, 0);
+        }
+    }
+    GByteArray *frame = g_byte_array_sized_new(payload->len + 16);
+    g_byte_array_append(frame, (const guint8 *)TERM_SESSION_MAGIC, 4);
+    appendBlock(frame, payload->data, payload->len);
+    appendU32(frame, payload->len);
+    g_byte_array_append(frame, (const guint8 *)TERM_SESSION_END, 4);
+    g_byte_array_free(payload, TRUE);
+    gchar *dir = g_path_get_dirname(sessionPath);
+    g_mkdir_with_parents(dir, 0700);
+    g_free(dir);
+    GStatBuf st;
+    gboolean written = FALSE;
+    if (g_stat(sessionPath, &st) == 0 && st.st_size + frame->len <= TERM_SESSION_MAX) {
+        int fd = open(sessionPath, O_WRONLY | O_APPEND | O_CLOEXEC);
+        if (fd != -1) {
+            written = write(fd, frame->data, frame->len) == (ssize_t)frame->len;
+            close(fd);
+        }
+    } else {
+        GError *error = NULL;
+        /* Compact the session file to the last snapshot */
+        written = g_file_set_contents(sessionPath, (const char *)frame->data,
+                                      frame->len, &error);
+        if (!written) {
+            printLog("An error occurred: %s\n", error->message);
+            g_clear_error(&error);
+        }
+        g_chmod(sessionPath, 0600);
+    }
+    printLog("session: %u tabs, %u bytes\n", snapshot->tabCount, frame->len);
+    g_byte_array_free(frame, TRUE);
+    /* Written again with the next snapshot */
+    if (!written)
+        g_atomic_int_set(&sessionFailed, 1);
+}
+
+/*!
+ * Queue the session snapshot of all windows for the session file.
+ *
+ * The layout of the windows is compared with the last snapshot first,
+ * the scrollbacks are only read if the layout or the output changed.
+ * Compression and file I/O run in the log writer thread.
+ *
+ * \param userData
+ * \return TRUE for keeping the source
+ */
+static gboolean saveSession(gpointer userData) {
+    UNUSED(userData);
+    SessionSnapshot *snapshot = g_new0(SessionSnapshot, 1);
+    snapshot->data = g_byte_array_new();
+    snapshot->parts = g_ptr_array_new_with_free_func((GDestroyNotify)g_bytes_unref);
+    snapshot->terminals = g_ptr_array_new_with_free_func(g_object_unref);
+    for (int i = 0; termWindows != NULL && i < termWindows->len; i++) {
+        GtkNotebook *notebook =
+            GTK_NOTEBOOK(((TermWindow *)g_ptr_array_index(termWindows, i))->notebook);
+        int current = gtk_notebook_get_current_page(notebook);
+        for (int j = 0; j < gtk_notebook_get_n_pages(notebook); j++)
+            snapshotTab(snapshot, i, j == current, gtk_notebook_get_nth_page(notebook, j));
+    }
+    flushSessionSnapshot(snapshot);
+    /* Layout is the literal runs with the tab count */
+    GByteArray *buffer = g_byte_array_new();
+    for (int i = 0; i < snapshot->parts->len; i++) {
+        gsize size;
+        gconstpointer part = g_bytes_get_data(g_ptr_array_index(snapshot->parts, i), &size);
+        g_byte_array_append(buffer, part, size);
+    }
+    appendU32(buffer, snapshot->tabCount);
+    GBytes *layout = g_byte_array_free_to_bytes(buffer);
+    /* Nothing changed since the last snapshot */
+    gboolean failed = g_atomic_int_compare_and_exchange(&sessionFailed, 1, 0);
+    if (!failed && lastSession != NULL && g_bytes_equal(layout, lastSession) &&
+        (snapshot->terminals->len == 0 || sessionOutput == lastSessionOutput)) {
+        g_bytes_unref(layout);
+        freeSessionSnapshot(snapshot);
+        return G_SOURCE_CONTINUE;
+    }
+    if (lastSession != NULL)
+        g_bytes_unref(lastSession);
+    lastSession = layout;
+    lastSessionOutput = sessionOutput;
+    snapshot->texts = g_ptr_array_new_with_free_func((GDestroyNotify)g_bytes_unref);
+    for (int i = 0; i < snapshot->terminals->len; i++)
+        g_ptr_array_add(snapshot->texts,
+                        getSessionText(g_ptr_array_index(snapshot->terminals, i)));
+    /* Terminals are not used by the writer thread */
+    g_ptr_array_set_size(snapshot->terminals, 0);
+    startLogWriter();
+    LogMessage *message = g_new0(LogMessage, 1);
+    message->type = TERM_LOG_SESSION;
+    message->snapshot = snapshot;
+    g_async_queue_push(logQueue, message);
+    return G_SOURCE_CONTINUE;
+}
+
+typedef struct {               /* Reader of the mapped session file */
+    GBytes *bytes;
+    const guint8 *data;
+    gsize size;
+    gsize offset;
+} SessionReader;
+
+/*!
+ * Read a 32-bit little-endian value from the session.
+ *
+ * \param reader
+ * \param value
+ * \return TRUE on success
+ */
+static gboolean readU32(SessionReader *reader, guint32 *value) {
+    if (reader->size - reader->offset < sizeof(*value))
+        return FALSE;
+    memcpy(value, reader->data + reader->offset, sizeof(*value));
+    *value = GUINT32_FROM_LE(*value);
+    reader->offset += sizeof(*value);
+    return TRUE;
+}
+
+/*!
+ * Read a length-prefixed block from the session.
+ *
+ * \param reader
+ * \param offset (offset of the block)
+ * \param size (size of the block)
+ * \return TRUE on success
+ */
+static gboolean readBlock(SessionReader *reader, gsize *offset, guint32 *size) {
+    if (!readU32(reader, size) || reader->size - reader->offset < *size)
+        return FALSE;
+    *offset = reader->offset;
+    reader->offset += *size;
+    return TRUE;
+}
+
+/*!
+ * Read a string from the session.
+ *
+ * \param reader
+ * \param value (NULL for an empty string)
+ * \return TRUE on success
+ */
+static gboolean readString(SessionReader *reader, char **value) {
+    gsize offset;
+    guint32 size;
+    if (!readBlock(reader, &offset, &size))
+        return FALSE;
+    *value = size ? g_strndup((const char *)reader->data + offset, size) : NULL;
+    return TRUE;
+}
+
+/*!
+ * Read a pane of the session tab.
+ *
+ * \param reader
+ * \param lazyTab
+ * \return TRUE on success
+ */
+static gboolean readLazyPane(SessionReader *reader, LazyTab *lazyTab) {
+    LazyPane *lazyPane = g_new0(LazyPane, 1);
+    guint32 scrollbackSize, size;
+    gsize offset;
+    g_ptr_array_add(lazyTab->panes, lazyPane);
+    if (!readString(reader, &lazyPane->dir) || !readString(reader, &lazyPane->title) ||
+        !readString(reader, &lazyPane->command) || !readU32(reader, &scrollbackSize) ||
+        !readBlock(reader, &offset, &size))
+        return FALSE;
+    if (size > 0) {
+        lazyPane->scrollback = g_bytes_new_from_bytes(reader->bytes, offset, size);
+        lazyPane->scrollbackSize = scrollbackSize;
+    }
     return TRUE;
 }
 
 /*!
- * Set the terminal font with given size.
+ * Find the payload of the last complete snapshot in the session file.
+ *
+ * \param reader
+ * \return TRUE if a snapshot is found
+ */
+static gboolean findSnapshot(SessionReader *reader) {
+    guint32 size;
+    /* Skip the partially written snapshots at the end */
+    for (gsize end = reader->size; end >= 16; end--) {
+        const guint8 *footer = reader->data + end - 8;
+        if (memcmp(footer + 4, TERM_SESSION_END, 4))
+            continue;
+        memcpy(&size, footer, sizeof(size));
+        size = GUINT32_FROM_LE(size);
+        if (size > end - 16)
+            continue;
+        const guint8 *header = footer - size - 8;
+        guint32 headerSize;
+        memcpy(&headerSize, header + 4, sizeof(headerSize));
+        if (memcmp(header, TERM_SESSION_MAGIC, 4) || GUINT32_FROM_LE(headerSize) != size)
+            continue;
+        reader->offset = header + 8 - reader->data;
+        reader->size = reader->offset + size;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+/*!
+ * Restore the windows and tabs of the last session snapshot.
+ *
+ * The file is memory-mapped and every tab is restored as a lazy tab
+ * -- only the active tab of each window is spawned. The compressed
+ * scrollback stays in the mapping until the tab is switched to.
+ *
+ * \return count of the restored windows
+ */
+static int restoreSession() {
+    GMappedFile *file = g_mapped_file_new(sessionPath, FALSE, NULL);
+    if (file == NULL)
+        return 0;
+    SessionReader reader = { .offset = 0 };
+    reader.bytes = g_mapped_file_get_bytes(file);
+    g_mapped_file_unref(file);
+    reader.data = g_bytes_get_data(reader.bytes, &reader.size);
+    guint32 version, tabCount, window, previous = 0, flags, paneCount;
+    int windowCount = 0, active = -1;
+    TermWindow *termWindow = NULL;
+    if (reader.data == NULL || !findSnapshot(&reader) || !readU32(&reader, &version) ||
+        version != TERM_SESSION_VERSION || !readU32(&reader, &tabCount))
+        tabCount = 0;
+    for (guint32 i = 0; i <= tabCount; i++) {
+        LazyTab *lazyTab = newLazyTab();
+        gboolean valid = i < tabCount && readU32(&reader, &window) &&
+            readU32(&reader, &flags) && readString(&reader, &lazyTab->layout) &&
+            readU32(&reader, &paneCount) && paneCount > 0 && paneCount <= TERM_SPLIT_MAX;
+        for (guint32 j = 0; valid && j < paneCount; j++)
+            valid = readLazyPane(&reader, lazyTab);
+        /* Finish the window on the next window or at the end */
+        if (termWindow != NULL && (!valid || window != previous)) {
+            GtkNotebook *notebook = GTK_NOTEBOOK(termWindow->notebook);
+            active = MAX(active, 0);
+            gtk_notebook_set_current_page(notebook, active);
+            g_signal_handlers_unblock_by_func(notebook, termTabOnAdd, NULL);
+            g_signal_handlers_unblock_by_func(notebook, termTabOnSwitch, termWindow);
+            termTabOnSwitch(notebook, gtk_notebook_get_nth_page(notebook, active),
+                            active, termWindow);
+            gtk_widget_show_all(termWindow->window);
+            termWindow = NULL;
+        }
+        if (!valid) {
+            freeLazyTab(lazyTab);
+            break;
+        }
+        if (termWindow == NULL) {
+            /* Switching is handled after all tabs are added */
+            termWindow = createWindow(NULL, termTitle);
+            g_signal_handlers_block_by_func(termWindow->notebook, termTabOnAdd, NULL);
+            g_signal_handlers_block_by_func(termWindow->notebook, termTabOnSwitch,
+                                            termWindow);
+            windowCount++;
+            previous = window;
+            active = -1;
+        }
+        int page = gtk_notebook_append_page(GTK_NOTEBOOK(termWindow->notebook),
+                                            newLazyPage(lazyTab), NULL);
+        if (flags & TERM_SESSION_ACTIVE)
+            active = page;
+    }
+    g_bytes_unref(reader.bytes);
+    printLog("session: %u tabs, %d windows restored\n", tabCount, windowCount);
+    return windowCount;
+}
+
+/*!
+ * Generate plain ASCII lines.
+ *
+ * \param data
+ */
+static void benchAscii(GString *data) {
+    while (data->len < TERM_BENCH_SIZE) {
+        for (int i = 0; i < 79; i++)
+            g_string_append_c(data, ' ' + 1 + (data->len + i) % 94);
+        g_string_append(data, "\r\n");
+    }
+}
+
+/*!
+ * Generate characters with dense SGR colors.
+ *
+ * \param data
+ */
+static void benchColors(GString *data) {
+    for (int i = 0; data->len < TERM_BENCH_SIZE; i++) {
+        g_string_append_printf(data, "\x1b[38;5;%d;48;5;%d;%dm%c",
+                               i % 256, (i * 7) % 256, i % 2 ? 1 : 22,
+                               'a' + i % 26);
+        if (i % 80 == 79)
+            g_string_append(data, "\x1b[0m\r\n");
+    }
+    g_string_append(data, "\x1b[0m");
+}
+
+/*!
+ * Generate lines of wide and combining Unicode characters.
+ *
+ * \param data
+ */
+static void benchUnicode(GString *data) {
+    static const char *words[] = { "漢字", "かな", "한글", "Ünïcödé", "e\xcc\x81",
+                                   "Ελληνικά", "кириллица", "─│┼", "🐸" };
+    for (int i = 0; data->len < TERM_BENCH_SIZE; i++) {
+        g_string_append(data, words[i % G_N_ELEMENTS(words)]);
+        g_string_append_c(data, i % 8 == 7 ? '\n' : ' ');
+        if (i % 8 == 7)
+            g_string_append_c(data, '\r');
+    }
+}
+
+/*!
+ * Generate a flood of short lines for scrolling.
+ *
+ * \param data
+ */
+static void benchScroll(GString *data) {
+    for (int i = 0; data->len < TERM_BENCH_SIZE; i++)
+        g_string_append_printf(data, "%d\r\n", i);
+}
+
+/*!
+ * Generate random cursor motion (vtebench style).
+ *
+ * \param data
+ */
+static void benchCursor(GString *data) {
+    for (guint seed = 1; data->len < TERM_BENCH_SIZE;) {
+        seed = seed * 1103515245 + 12345;
+        g_string_append_printf(data, "\x1b[%u;%uH%c",
+                               (seed >> 16) % 24 + 1, (seed >> 8) % 80 + 1,
+                               'A' + seed % 26);
+    }
+}
+
+static const struct {          /* Benchmark workloads */
+    const char *name;
+    void (*generate)(GString *data);
+} benchWorkloads[] = {
+    { "ascii", benchAscii },
+    { "sgr-colors", benchColors },
+    { "unicode", benchUnicode },
+    { "scroll", benchScroll },
+    { "cursor-motion", benchCursor },
+};
+
+static struct {                /* Benchmark state */
+    GtkWidget *terminal;       /* Terminal to feed */
+    GString *report;           /* JSON report */
+    int workload;              /* Index of the running workload */
+    gsize bytes;               /* Size of the running workload */
+    gint64 start;              /* Start time of the running workload */
+    gint64 lastPaint;          /* Time of the last paint */
+    guint frames;              /* Paints during the workload */
+    gint64 frameTotal;         /* Sum of the frame times */
+    gint64 frameMax;           /* Longest frame time */
+    int samples;               /* Latency samples taken */
+    gint64 latencyStart;       /* Feed time of the latency sample */
+    gint64 latencyTotal;       /* Sum of the latencies */
+    gint64 latencyMax;         /* Longest latency */
+} bench;
+
+/*!
+ * Print the benchmark report and exit.
+ */
+static void finishBench() {
+    g_string_append_printf(bench.report,
+                           "],\"latency\":{\"samples\":%d,\"mean_ms\":%.3f,"
+                           "\"max_ms\":%.3f}}\n",
+                           bench.samples,
+                           bench.samples ? bench.latencyTotal / 1000.0 / bench.samples : 0,
+                           bench.latencyMax / 1000.0);
+    fputs(bench.report->str, stdout);
+    fflush(stdout);
+    g_string_free(bench.report, TRUE);
+    bench.report = NULL;
+    gtk_main_quit();
+}
+
+/*!
+ * Start the next workload of the benchmark.
+ *
+ * \param userData
+ * \return FALSE for removing the source
+ */
+static gboolean benchNext(gpointer userData) {
+    UNUSED(userData);
+    /* Clear the screen and the scrollback */
+    vte_terminal_reset(VTE_TERMINAL(bench.terminal), TRUE, TRUE);
+    if (bench.workload == G_N_ELEMENTS(benchWorkloads)) {
+        /* Measure the latency of the single characters */
+        bench.latencyStart = g_get_monotonic_time();
+        vte_terminal_feed(VTE_TERMINAL(bench.terminal), "x", 1);
+        return G_SOURCE_REMOVE;
+    }
+    GString *data = g_string_sized_new(TERM_BENCH_SIZE + TERM_BUFFER_SIZE);
+    benchWorkloads[bench.workload].generate(data);
+    /* Title change marks the end of the workload */
+    g_string_append_printf(data, "\x1b]2;%s-bench-%d\x07", TERM_NAME, bench.workload);
+    bench.bytes = data->len;
+    bench.frames = 0;
+    bench.frameTotal = bench.frameMax = 0;
+    bench.start = bench.lastPaint = g_get_monotonic_time();
+    vte_terminal_feed(VTE_TERMINAL(bench.terminal), data->str, data->len);
+    g_string_free(data, TRUE);
+    return G_SOURCE_REMOVE;
+}
+
+/*!
+ * Finish the workload when its terminating title arrives.
+ *
+ * \param terminal
+ * \param userData
+ */
+static void benchOnTitleChanged(GtkWidget *terminal, gpointer userData) {
+    UNUSED(userData);
+    gchar *title = g_strdup_printf("%s-bench-%d", TERM_NAME, bench.workload);
+    if (bench.workload < G_N_ELEMENTS(benchWorkloads) &&
+        !g_strcmp0(vte_terminal_get_window_title(VTE_TERMINAL(terminal)), title)) {
+        double seconds = (g_get_monotonic_time() - bench.start) / (double)G_USEC_PER_SEC;
+        g_string_append_printf(bench.report,
+                               "%s{\"name\":\"%s\",\"bytes\":%" G_GSIZE_FORMAT ","
+                               "\"seconds\":%.6f,\"bytes_per_second\":%.0f,"
+                               "\"frames\":%u,\"frame_ms_mean\":%.3f,"
+                               "\"frame_ms_max\":%.3f}",
+                               bench.workload ? "," : "",
+                               benchWorkloads[bench.workload].name, bench.bytes,
+                               seconds, bench.bytes / seconds, bench.frames,
+                               bench.frames ? bench.frameTotal / 1000.0 / bench.frames : 0,
+                               bench.frameMax / 1000.0);
+        bench.workload++;
+        g_idle_add(benchNext, NULL);
+    }
+    g_free(title);
+}
+
+/*!
+ * Record the frame times and the latency samples.
+ *
+ * \param frameClock
+ * \param userData
+ */
+static void benchOnPaint(GdkFrameClock *frameClock, gpointer userData) {
+    UNUSED(frameClock);
+    UNUSED(userData);
+    gint64 now = g_get_monotonic_time();
+    if (bench.report == NULL)
+        return;
+    if (bench.latencyStart != 0) {
+        gint64 latency = now - bench.latencyStart;
+        bench.latencyTotal += latency;
+        bench.latencyMax = MAX(bench.latencyMax, latency);
+        if (++bench.samples == TERM_BENCH_SAMPLES) {
+            finishBench();
+            return;
+        }
+        bench.latencyStart = g_get_monotonic_time();
+        vte_terminal_feed(VTE_TERMINAL(bench.terminal), "x", 1);
+    } else if (bench.workload < G_N_ELEMENTS(benchWorkloads)) {
+        bench.frames++;
+        bench.frameTotal += now - bench.lastPaint;
+        bench.frameMax = MAX(bench.frameMax, now - bench.lastPaint);
+        bench.lastPaint = now;
+    }
+}
+
+/*!
+ * Start the benchmark after the terminal is mapped.
+ *
+ * \param terminal
+ * \param userData
+ */
+static void benchOnMap(GtkWidget *terminal, gpointer userData) {
+    UNUSED(userData);
+    if (bench.report != NULL)
+        return;
+    bench.report = g_string_new(NULL);
+    g_string_append_printf(bench.report,
+                           "{\"version\":\"%s\",\"columns\":%ld,\"rows\":%ld,"
+                           "\"workloads\":[",
+                           TERM_VERSION,
+                           vte_terminal_get_column_count(VTE_TERMINAL(terminal)),
+                           vte_terminal_get_row_count(VTE_TERMINAL(terminal)));
+    g_signal_connect(gtk_widget_get_frame_clock(terminal), "after-paint",
+                     G_CALLBACK(benchOnPaint), NULL);
+    g_idle_add(benchNext, NULL);
+}
+
+/*!
+ * Abort the benchmark if it doesn't finish in time.
+ *
+ * \param userData
+ * \return FALSE for removing the source
+ */
+static gboolean benchOnTimeout(gpointer userData) {
+    UNUSED(userData);
+    fprintf(stderr, "Benchmark timed out\n");
+    gtk_main_quit();
+    return G_SOURCE_REMOVE;
+}
+
+/*!
+ * Open a window for feeding the benchmark workloads into the terminal.
+ */
+static void startBench() {
+    GtkWidget *window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
+    gtk_window_set_title(GTK_WINDOW(window), TERM_NAME);
+    g_signal_connect(window, "delete-event", gtk_main_quit, NULL);
+    /* Terminal without a child process */
+    bench.terminal = vte_terminal_new();
+    configureTerm(bench.terminal);
+    g_signal_connect(bench.terminal, "window-title-changed",
+                     G_CALLBACK(benchOnTitleChanged), NULL);
+    g_signal_connect(bench.terminal, "map", G_CALLBACK(benchOnMap), NULL);
+    gtk_container_add(GTK_CONTAINER(window), bench.terminal);
+    gtk_widget_show_all(window);
+    g_timeout_add_seconds(TERM_BENCH_TIMEOUT, benchOnTimeout, NULL);
+}
+
+/*!
+ * Write the rows of the terminal as text to the standard output.
+ *
+ * \param terminal
+ * \param start (first row)
+ * \param end (last row + 1)
+ */
+static void writeRows(GtkWidget *terminal, glong start, glong end) {
+    if (end <= start)
+        return;
+    gchar *text = vte_terminal_get_text_range(
+        VTE_TERMINAL(terminal), start, 0, end - 1,
+        vte_terminal_get_column_count(VTE_TERMINAL(terminal)) - 1, NULL, NULL, NULL);
+    if (text != NULL) {
+        fputs(text, stdout);
+        if (*text && text[strlen(text) - 1] != '\n')
+            fputc('\n', stdout);
+        g_free(text);
+    }
+}
+
+/*!
+ * Write the visible screen of the headless terminal as a frame.
+ *
+ * \param userData (terminal)
+ * \return TRUE for keeping the source
+ */
+static gboolean headlessOnFrame(gpointer userData) {
+    GtkWidget *terminal = userData;
+    GtkAdjustment *adjustment = gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(terminal));
+    glong end = (glong)gtk_adjustment_get_upper(adjustment);
+    writeRows(terminal, end - vte_terminal_get_row_count(VTE_TERMINAL(terminal)), end);
+    /* Frames are separated by form feeds */
+    fputs("\f\n", stdout);
+    return G_SOURCE_CONTINUE;
+}
+
+/*!
+ * Quit the headless mode on the exit of the command.
+ *
+ * \param terminal
+ * \param status
+ * \param userData
+ */
+static void headlessOnChildExit(VteTerminal *terminal, gint status, gpointer userData) {
+    UNUSED(terminal);
+    UNUSED(userData);
+    headlessStatus = WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+    gtk_main_quit();
+}
+
+/*!
+ * Run the command in a terminal that is never mapped.
  *
- * \param terminal
- * \param fontSize
- * \return 0 on success
+ * The terminal uses the same configuration as the windows, but
+ * nothing is rendered. The scrollback and the screen are written
+ * to the standard output when the command exits.
+ *
+ * \return exit status of the command
  */
-static int setTermFont(GtkWidget *terminal, int fontSize) {
-    gchar *fontStr = g_strconcat(termFont, " ",
-                                 g_strdup_printf("%d", fontSize), NULL);
-    if ((fontDesc = pango_font_description_from_string(fontStr)) != NULL) {
-        vte_terminal_set_font(VTE_TERMINAL(terminal), fontDesc);
-        currentFontSize = fontSize;
-        pango_font_description_free(fontDesc);
-        g_free(fontStr);
+static int startHeadless() {
+    if (termCommand == NULL) {
+        fprintf(stderr, "Headless mode requires a command (-e)\n");
+        return 1;
     }
-    return 0;
+    GtkWidget *terminal = g_object_ref_sink(getTerm(workingDir, termCommand));
+    vte_terminal_set_size(VTE_TERMINAL(terminal), TERM_HEADLESS_COLUMNS, TERM_HEADLESS_ROWS);
+    g_signal_connect(terminal, "child-exited", G_CALLBACK(headlessOnChildExit), NULL);
+    guint frameSource = headlessInterval > 0 ?
+        g_timeout_add(headlessInterval, headlessOnFrame, terminal) : 0;
+    gtk_main();
+    if (frameSource != 0)
+        g_source_remove(frameSource);
+    GtkAdjustment *adjustment = gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(terminal));
+    writeRows(terminal, (glong)gtk_adjustment_get_lower(adjustment),
+              (glong)gtk_adjustment_get_upper(adjustment));
+    fflush(stdout);
+    gtk_widget_destroy(terminal);
+    g_object_unref(terminal);
+    return headlessStatus;
 }
 
 /*!
- * Update the palette and set terminal colors.
+ * Initialize and start the terminal.
  *
- * \param terminal
  * \return 0 on success
  */
-static int setTermColors(GtkWidget *terminal) {
-    for (int i = colorCount; i < 256; i++) {
-        if (i < 16) {
-            termPalette[i].blue = (((i & 4) ? 0xc000 : 0) + (i > 7 ? 0x3fff : 0)) / 65535.0;
-            termPalette[i].green = (((i & 2) ? 0xc000 : 0) + (i > 7 ? 0x3fff : 0)) / 65535.0;
-            termPalette[i].red = (((i & 1) ? 0xc000 : 0) + (i > 7 ? 0x3fff : 0)) / 65535.0;
-            termPalette[i].alpha = 0;
-        } else if (i < 232) {
-            const unsigned j = i - 16;
-            const unsigned r = j / 36, g = (j / 6) % 6, b = j % 6;
-            termPalette[i].red = ((r == 0) ? 0 : r * 40 + 55) / 255.0;
-            termPalette[i].green = ((g == 0) ? 0 : g * 40 + 55) / 255.0;
-            termPalette[i].blue = ((b == 0) ? 0 : b * 40 + 55) / 255.0;
-            termPalette[i].alpha = 0;
-        } else if (i < 256) {
-            const unsigned shade = 8 + (i - 232) * 10;
-            termPalette[i].red = termPalette[i].green =
-                termPalette[i].blue = (shade | shade << 8) / 65535.0;
-            termPalette[i].alpha = 0;
-        }
+static int startTerm() {
+    termWindows = g_ptr_array_new();
+    resolveTheme();
+    markStartup("theme");
+    if (debugMessages) {
+        g_unix_signal_add(SIGUSR1, exportStats, NULL);
+        g_unix_signal_add(SIGUSR2, exportTrace, NULL);
+    }
+    if (serverMode && startServer())
+        return 1;
+    if (benchMode) {
+        startBench();
+        gtk_main();
+        return 0;
+    }
+    if (headlessMode) {
+        int status = startHeadless();
+        stopLogWriter();
+        return status;
+    }
+    /* Restore the session unless a command or directory is given */
+    int windowCount = 0;
+    if (sessionInterval > 0) {
+        sessionPath = g_build_filename(g_get_user_cache_dir(), TERM_NAME,
+                                       TERM_SESSION_NAME, NULL);
+        if (termCommand == NULL && workingDir == NULL)
+            windowCount = restoreSession();
+        g_timeout_add_seconds(sessionInterval, saveSession, NULL);
+    }
+    /* Server waits for the client requests */
+    if (!serverMode && windowCount == 0)
+        newWindow(workingDir, termCommand, termTitle);
+    schedulePoolRefill();
+    updateThrottle();
+    updateHibernate();
+    watchConfig();
+    /* Run the main loop */
+    gtk_main();
+    /* Closing the last window clears the session */
+    if (sessionInterval > 0)
+        saveSession(NULL);
+    stopLogWriter();
+    if (serverSocket != -1) {
+        close(serverSocket);
+        unlink(socketPath);
     }
-    vte_terminal_set_colors(VTE_TERMINAL(terminal),
-                            &CLR_GDK(termForeground, 0),           /* Foreground */
-                            &CLR_GDK(termBackground, termOpacity), /* Background */
-                            termPalette,                           /* Palette */
-                            sizeof(termPalette) / sizeof(GdkRGBA));
-    vte_terminal_set_color_bold(VTE_TERMINAL(terminal),
-                                &CLR_GDK(termBoldColor, 0));
     return 0;
 }
 
 /*!
- * Configure the terminal.
+ * Print the configuration error with the file name and line number.
  *
- * \param terminal
- * \return 0 on success
+ * \param format
+ * \param ...
  */
-static int configureTerm(GtkWidget *terminal) {
-    /* Set numeric locale */
-    setlocale(LC_NUMERIC, termLocale);
-    /* Hide the mouse cursor when typing */
-    vte_terminal_set_mouse_autohide(VTE_TERMINAL(terminal), TRUE);
-    /* Scroll issues */
-    vte_terminal_set_scroll_on_output(VTE_TERMINAL(terminal), FALSE);
-    vte_terminal_set_scroll_on_keystroke(VTE_TERMINAL(terminal), TRUE);
-    vte_terminal_set_scrollback_lines(VTE_TERMINAL(terminal), -1);
-    /* Rewrap the content when terminal size changed */
-    vte_terminal_set_rewrap_on_resize(VTE_TERMINAL(terminal), TRUE);
-    /* Disable audible bell */
-    vte_terminal_set_audible_bell(VTE_TERMINAL(terminal), FALSE);
-    /* Enable bold text */
-    vte_terminal_set_allow_bold(VTE_TERMINAL(terminal), TRUE);
-    /* Allow hyperlinks */
-    vte_terminal_set_allow_hyperlink(VTE_TERMINAL(terminal), TRUE);
-    /* Set char exceptions */
-    vte_terminal_set_word_char_exceptions(VTE_TERMINAL(terminal),
-                                          termWordChars);
-    /* Zuckerberg feature */
-    vte_terminal_set_cursor_blink_mode(VTE_TERMINAL(terminal),
-                                       VTE_CURSOR_BLINK_OFF);
-    /* Set cursor options */
-    vte_terminal_set_color_cursor(VTE_TERMINAL(terminal),
-                                  &CLR_GDK(termCursorColor, 0));
-    vte_terminal_set_color_cursor_foreground(VTE_TERMINAL(terminal),
-                                             &CLR_GDK(termCursorFg, 0));
-    vte_terminal_set_cursor_shape(VTE_TERMINAL(terminal), termCursorShape);
-    /* Set the terminal colors and font */
-    setTermColors(terminal);
-    setTermFont(terminal, defaultFontSize);
-    return 0;
+static void configError(const char *format, ...) {
+    va_list vargs;
+    fprintf(stderr, "%s:%d: ", configFileName, configLine);
+    va_start(vargs, format);
+    vfprintf(stderr, format, vargs);
+    va_end(vargs);
+    fputc('\n', stderr);
 }
 
 /*!
- * Async callback for terminal state.
+ * Parse the color value.
  *
- * \param terminal
- * \param pid (Process ID)
- * \param error
- * \param userData
+ * \param value (0xRRGGBB or #RRGGBB)
+ * \return color
  */
-static void termStateCallback(VteTerminal *terminal, GPid pid,
-                              GError *error, gpointer userData) {
-    if (error == NULL) {
-        printLog("%s started. (PID: %d)\n", TERM_NAME, pid);
-    } else {
-        printLog("An error occurred: %s\n", error->message);
-        g_clear_error(&error);
-    }
-    UNUSED(userData);
-    UNUSED(terminal);
+static int parseColor(const char *value) {
+    char *end;
+    if (value[0] == '#')
+        value++;
+    int color = (int)strtol(value, &end, 16);
+    if (end == value || *end != 0)
+        configError("invalid color '%s'", value);
+    return color;
 }
 
 /*!
- * Create a new terminal widget with a shell.
+ * Parse the integer value.
  *
- * \return terminal
+ * \param value
+ * \return integer
  */
-static GtkWidget *getTerm() {
-    /* Create a terminal widget */
-    GtkWidget *terminal = vte_terminal_new();
-    /* Terminal configuration */
-    connectSignals(terminal);
-    configureTerm(terminal);
-    /* Start a new shell */
-    envp = g_get_environ();
-    command = (gchar *[]){g_strdup(g_environ_getenv(envp, "SHELL")), NULL};
-    printLog("shell: %s\n", *command);
-    if (termCommand != NULL) {
-        command = (gchar *[]){g_strdup(g_environ_getenv(envp, "SHELL")),
-                              "-c", termCommand, NULL};
-        printLog("command: %s %s %s\n", command[0], command[1], command[2]);
+static int parseInt(const char *value) {
+    char *end;
+    long number = strtol(value, &end, 10);
+    if (end == value || *end != 0)
+        configError("invalid number '%s'", value);
+    return (int)number;
+}
+
+/* Configuration option parsers (name, color index and value) */
+static void parseLocale(const char *name, int index, char *value) {
+    termLocale = g_strdup(value);
+}
+
+static void parseWordChars(const char *name, int index, char *value) {
+    gsize len = strlen(value);
+    /* Remove '"' from word chars */
+    if (len < 2 || value[0] != '"' || value[len - 1] != '"') {
+        configError("word chars should be quoted");
+        return;
     }
-    g_strfreev(envp);
-    if (workingDir == NULL) {
-        workingDir = g_get_current_dir();
+    g_free(wordChars);
+    wordChars = g_strndup(value + 1, len - 2);
+    termWordChars = wordChars;
+}
+
+static void parseMatch(const char *name, int index, char *value) {
+    /* Split the pattern and the command */
+    char *cmd = g_strrstr(value, "~\"");
+    gsize len = cmd != NULL ? strlen(cmd) : 0;
+    if (cmd == NULL || cmd == value || len < 3 || cmd[len - 1] != '"') {
+        configError("invalid match, expected PATTERN~\"COMMAND\"");
+        return;
     }
-    printLog("workdir: %s\n", g_get_current_dir());
-    /* Spawn terminal asynchronously */
-    vte_terminal_spawn_async(VTE_TERMINAL(terminal),
-                             VTE_PTY_DEFAULT,   /* pty flag */
-                             workingDir,        /* working directory */
-                             command,           /* argv */
-                             NULL,              /* environment variables */
-                             G_SPAWN_DEFAULT,   /* spawn flag */
-                             NULL,              /* child setup function */
-                             NULL,              /* child setup data */
-                             NULL,              /* child setup data destroy */
-                             -1,                /* timeout */
-                             NULL,              /* cancellable */
-                             termStateCallback, /* async callback */
-                             NULL);             /* callback data */
-    /* Show the terminal widget */
-    gtk_widget_show(terminal);
-    return terminal;
+    MatchPattern *pattern = g_new0(MatchPattern, 1);
+    pattern->pattern = g_strndup(value, cmd - value);
+    pattern->command = g_strndup(cmd + 2, len - 3);
+    GError *error = NULL;
+    if (!compileMatchPattern(pattern, &error)) {
+        configError("invalid match pattern: %s", error->message);
+        g_clear_error(&error);
+        freeMatchPattern(pattern);
+        return;
+    }
+    g_ptr_array_add(matchPatterns, pattern);
+    printLog("match %u = %s -> \"%s\"\n", matchPatterns->len, pattern->pattern,
+             pattern->command);
 }
 
-/*!
- * Invalidate the default binding with the corresponding action
- *
- * \param binding
- */
-static void invalidateDefaultBinding(const Bindings *binding) {
-    for (int i = 0; i < defaultKeyCount; i++) {
-        if (strcmp(defaultKeyBindings[i].bind.cmd, binding->cmd) == 0
-            && defaultKeyBindings[i].bind.internal == binding->internal) {
-            defaultKeyBindings[i].invalid = TRUE;
-        }
+static void parseActionKey(const char *name, int index, char *value) {
+    if (!strcmp(value, "alt"))
+        actionKey = GDK_MOD1_MASK;
+    else
+        actionKey = GDK_SHIFT_MASK;
+}
+
+static void parseBinding(const char *name, int index, char *value) {
+    /* Split the line and the values */
+    char *cmd = strchr(value, '~');
+    gsize len = cmd != NULL ? strlen(cmd) : 0;
+    if (cmd == NULL || cmd == value || len < 3 || cmd[1] != '"' || cmd[len - 1] != '"') {
+        configError("invalid key binding, expected KEY~\"COMMAND\"");
+        return;
+    }
+    /* Trim the quotes, execute option appends carriage return to command */
+    *cmd = 0;
+    cmd[len - 1] = !strcmp(name, "bindx") ? '\r' : 0;
+    cmd += 2;
+    Bindings binding = {
+        /* Internal option is specified */
+        .internal = !strcmp(name, "bindi"),
+        .key = g_string_chunk_insert_const(bindingStrings, value),
+        .cmd = g_string_chunk_insert_const(bindingStrings, cmd),
+    };
+    g_array_append_val(keyBindings, binding);
+    printLog("cmd %u = %s -> \"%s\"\n", keyBindings->len, binding.key, binding.cmd);
+    /* Invalidate associated default bindings */
+    invalidateDefaultBinding(&binding);
+}
+
+static void parseTabPosition(const char *name, int index, char *value) {
+    if (!strcmp(value, "bottom"))
+        tabPosition = 0;
+    else
+        tabPosition = 1;
+}
+
+static void parseFont(const char *name, int index, char *value) {
+    /* Split the line and get last element */
+    char *size = strrchr(value, ' ');
+    if (size == NULL) {
+        configError("font size is missing");
+        return;
+    }
+    /* Get the font information excluding font size */
+    *size = 0;
+    defaultFontSize = parseInt(size + 1);
+    g_free(termFontName);
+    termFontName = g_strdup(g_strchomp(value));
+    termFont = termFontName;
+}
+
+static void parseOpacity(const char *name, int index, char *value) {
+    termOpacity = atof(value);
+}
+
+static void parsePrespawn(const char *name, int index, char *value) {
+    prespawnCount = CLAMP(parseInt(value), 0, TERM_PRESPAWN_MAX);
+}
+
+static void parseScrollback(const char *name, int index, char *value) {
+    char *suffix;
+    /* Scrollback lines or byte budget (K/M/G suffix) */
+    long size = strtol(value, &suffix, 10);
+    switch (*suffix) {
+        case 'k': case 'K': termScrollbackBytes = size << 10; break;
+        case 'm': case 'M': termScrollbackBytes = size << 20; break;
+        case 'g': case 'G': termScrollbackBytes = size << 30; break;
+        case 0:
+            termScrollback = size;
+            termScrollbackBytes = 0;
+            break;
+        default:
+            configError("invalid scrollback '%s'", value);
+    }
+}
+
+static void parseRewrap(const char *name, int index, char *value) {
+    if (!strcmp(value, "off"))
+        termRewrap = TERM_REWRAP_OFF;
+    else if (!strcmp(value, "on"))
+        termRewrap = TERM_REWRAP_ON;
+    else if (!strcmp(value, "lazy"))
+        termRewrap = TERM_REWRAP_LAZY;
+    else
+        configError("invalid rewrap '%s'", value);
+}
+
+static void parseRender(const char *name, int index, char *value) {
+    if (!strcmp(value, "auto"))
+        termRender = TERM_RENDER_AUTO;
+    else if (!strcmp(value, "opaque"))
+        termRender = TERM_RENDER_OPAQUE;
+    else if (!strcmp(value, "alpha"))
+        termRender = TERM_RENDER_ALPHA;
+    else
+        configError("invalid render '%s'", value);
+}
+
+static void parsePasteConfirm(const char *name, int index, char *value) {
+    char *suffix;
+    /* Size in bytes (K/M/G suffix) */
+    long size = strtol(value, &suffix, 10);
+    switch (*suffix) {
+        case 'k': case 'K': size <<= 10; break;
+        case 'm': case 'M': size <<= 20; break;
+        case 'g': case 'G': size <<= 30; break;
+        case 0: break;
+        default:
+            configError("invalid size '%s'", value);
+            return;
+    }
+    pasteConfirm = MAX(size, 0);
+}
+
+static void parsePasteBracketed(const char *name, int index, char *value) {
+    pasteBracketed = strcmp(value, "off") != 0;
+}
+
+static void parseHibernate(const char *name, int index, char *value) {
+    hibernateInterval = MAX(parseInt(value), 0);
+}
+
+static void parseThrottle(const char *name, int index, char *value) {
+    throttleInterval = MAX(parseInt(value), 0);
+}
+
+static void parseSession(const char *name, int index, char *value) {
+    sessionInterval = MAX(parseInt(value), 0);
+}
+
+static void parseSessionLines(const char *name, int index, char *value) {
+    sessionLines = MAX(parseInt(value), 0);
+}
+
+static void parseAutoReload(const char *name, int index, char *value) {
+    autoReload = strcmp(value, "off") != 0;
+}
+
+static void parseLog(const char *name, int index, char *value) {
+    logAll = strcmp(value, "off") != 0;
+}
+
+static void parseLogDir(const char *name, int index, char *value) {
+    g_free(logDir);
+    /* Expand the home directory */
+    if (value[0] == '~')
+        logDir = g_build_filename(g_get_home_dir(), value + 1, NULL);
+    else
+        logDir = g_strdup(value);
+}
+
+static void parseLogCompress(const char *name, int index, char *value) {
+    logCompress = strcmp(value, "off") != 0;
+}
+
+static void parseCursorColor(const char *name, int index, char *value) {
+    termCursorColor = parseColor(value);
+}
+
+static void parseCursorFg(const char *name, int index, char *value) {
+    termCursorFg = parseColor(value);
+}
+
+static void parseCursorShape(const char *name, int index, char *value) {
+    if (!strcmp(value, "underline"))
+        termCursorShape = VTE_CURSOR_SHAPE_UNDERLINE;
+    else if (!strcmp(value, "ibeam"))
+        termCursorShape = VTE_CURSOR_SHAPE_IBEAM;
+    else
+        termCursorShape = VTE_CURSOR_SHAPE_BLOCK;
+}
+
+static void parseForeground(const char *name, int index, char *value) {
+    termForeground = parseColor(value);
+}
+
+static void parseBoldColor(const char *name, int index, char *value) {
+    termBoldColor = parseColor(value);
+}
+
+static void parseBackground(const char *name, int index, char *value) {
+    termBackground = parseColor(value);
+}
+
+static void parsePaletteColor(const char *name, int index, char *value) {
+    if (index < 0 || index >= TERM_PALETTE_SIZE) {
+        configError("color index should be between 0 and %d", TERM_PALETTE_SIZE - 1);
+        return;
     }
+    termPalette[index] = CLR_GDK(parseColor(value), 0);
+    colorCount++;
 }
 
+typedef struct {               /* Configuration option */
+    const char *name;
+    void (*parse)(const char *name, int index, char *value);
+    gboolean indexed;          /* Followed by an index (e.g. color0) */
+} ConfigOption;
+
+/* Perfect hash table of the options, slots are TERM_CONFIG_HASH of the names */
+static const ConfigOption configOptions[TERM_CONFIG_SLOTS] = {
+    [0] = { "color", parsePaletteColor, TRUE },
+    [1] = { "cursor", parseCursorColor },
+    [7] = { "bindx", parseBinding },
+    [11] = { "log_dir", parseLogDir },
+    [16] = { "render", parseRender },
+    [22] = { "bind", parseBinding },
+    [27] = { "autoreload", parseAutoReload },
+    [28] = { "background", parseBackground },
+    [32] = { "foreground", parseForeground },
+    [35] = { "log", parseLog },
+    [36] = { "cursor_foreground", parseCursorFg },
+    [37] = { "foreground_bold", parseBoldColor },
+    [47] = { "paste_bracketed", parsePasteBracketed },
+    [56] = { "rewrap", parseRewrap },
+    [57] = { "paste_confirm", parsePasteConfirm },
+    [58] = { "key", parseActionKey },
+    [60] = { "log_compress", parseLogCompress },
+    [66] = { "opacity", parseOpacity },
+    [68] = { "session_lines", parseSessionLines },
+    [75] = { "cursor_shape", parseCursorShape },
+    [77] = { "hibernate", parseHibernate },
+    [78] = { "locale", parseLocale },
+    [79] = { "tab", parseTabPosition },
+    [82] = { "match", parseMatch },
+    [88] = { "throttle", parseThrottle },
+    [90] = { "font", parseFont },
+    [96] = { "prespawn", parsePrespawn },
+    [97] = { "scrollback", parseScrollback },
+    [98] = { "session", parseSession },
+    [115] = { "bindi", parseBinding },
+    [127] = { "char", parseWordChars },
+};
+
 /*!
- * Initialize and start the terminal.
+ * Find the configuration option by name.
  *
- * \return 0 on success
+ * \param name (not null-terminated)
+ * \param len
+ * \return option (NULL if not found)
  */
-static int startTerm() {
-    /* Create & configure the window widget */
-    window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
-    if (termTitle == NULL)
-        gtk_window_set_title(GTK_WINDOW(window), TERM_NAME);
-    else
-        gtk_window_set_title(GTK_WINDOW(window), termTitle);
-    gtk_widget_set_visual(window, /* Alpha channel for transparency */
-                          gdk_screen_get_rgba_visual(gtk_widget_get_screen(window)));
-    gtk_widget_override_background_color(window, GTK_STATE_FLAG_NORMAL,
-                                         &CLR_GDK(termBackground, termOpacity));
-    /* Create & configure the paned widget */
-    paned = gtk_paned_new(GTK_ORIENTATION_VERTICAL);
-    gtk_paned_set_wide_handle(GTK_PANED(paned), FALSE);
-    /* Create & configure the notebook widget */
-    notebook = gtk_notebook_new();
-    gtk_notebook_set_tab_pos(GTK_NOTEBOOK(notebook), GTK_POS_BOTTOM);
-    gtk_notebook_set_scrollable(GTK_NOTEBOOK(notebook), TRUE);
-    gtk_notebook_popup_disable(GTK_NOTEBOOK(notebook));
-    gtk_notebook_set_show_tabs(GTK_NOTEBOOK(notebook), FALSE);
-    gtk_notebook_set_show_border(GTK_NOTEBOOK(notebook), FALSE);
-    /* Connect signals of window and notebook for tab feature */
-    g_signal_connect(window, "delete-event", gtk_main_quit, NULL);
-    g_signal_connect(window, "size-allocate", G_CALLBACK(termOnResize), paned);
-    g_signal_connect(notebook, "page-added", G_CALLBACK(termTabOnAdd), NULL);
-    g_signal_connect(notebook, "switch-page", G_CALLBACK(termTabOnSwitch), NULL);
-    /* Add terminal to notebook as first tab */
-    gtk_notebook_append_page(GTK_NOTEBOOK(notebook), getTerm(), NULL);
-    /* Add notebook to paned */
-    if (tabPosition == 0)
-        gtk_paned_add1(GTK_PANED(paned), notebook);
-    else
-        gtk_paned_add2(GTK_PANED(paned), notebook);
-    /* Add paned to main window */
-    gtk_container_add(GTK_CONTAINER(window), paned);
-    /* Show all widgets with childs and run the main loop */
-    gtk_widget_show_all(window);
-    gtk_main();
-    return 0;
+static const ConfigOption *findConfigOption(const char *name, gsize len) {
+    if (len == 0)
+        return NULL;
+    const ConfigOption *option =
+        &configOptions[TERM_CONFIG_HASH(name[0], name[len - 1], len)];
+    if (option->name == NULL || strlen(option->name) != len ||
+        memcmp(option->name, name, len))
+        return NULL;
+    return option;
 }
 
 /*!
- * Parse the color value.
+ * Parse a line of the configuration file.
  *
- * \param value
- * \return color
+ * \param line
+ * \param end (end of the line)
+ * \param value (buffer for the value)
  */
-static int parseColor(char *value) {
-    if (value[0] == '#') {
-        memmove(value, value + 1, strlen(value));
-        sprintf(value, "%s", g_strconcat("0x", value, NULL));
+static void parseLine(const char *line, const char *end, GString *value) {
+    /* Trim the line and skip the comments */
+    while (line < end && g_ascii_isspace(*line))
+        line++;
+    while (end > line && g_ascii_isspace(end[-1]))
+        end--;
+    if (line == end || *line == '#')
+        return;
+    /* Split the line into option name and value */
+    const char *name = line;
+    while (line < end && !g_ascii_isspace(*line))
+        line++;
+    gsize len = line - name;
+    while (line < end && g_ascii_isspace(*line))
+        line++;
+    g_string_truncate(value, 0);
+    g_string_append_len(value, line, end - line);
+    /* Options with an index are looked up without the digits */
+    int index = -1;
+    const ConfigOption *option = findConfigOption(name, len);
+    if (option == NULL) {
+        gsize digits = len;
+        while (digits > 0 && g_ascii_isdigit(name[digits - 1]))
+            digits--;
+        option = findConfigOption(name, digits);
+        if (option != NULL && option->indexed && digits < len && len - digits < 4) {
+            index = 0;
+            for (gsize i = digits; i < len; i++)
+                index = index * 10 + name[i] - '0';
+        } else {
+            option = NULL;
+        }
     }
-    return (int)strtol(value, NULL, 16);
+    if (option == NULL)
+        configError("unknown option '%.*s'", (int)len, name);
+    else if (value->len == 0)
+        configError("missing value for '%.*s'", (int)len, name);
+    else
+        option->parse(option->name, index, value->str);
 }
 
 /*!
  * Read settings from configuration file and apply.
+ *
+ * The file is memory-mapped and parsed in a single pass. Key bindings
+ * of each parse are stored in a new array and string arena, and the
+ * previous ones are released at once after the key table is rebuilt.
  */
 static void parseSettings() {
-    char buf[TERM_CONFIG_LENGTH],
-        option[TERM_CONFIG_LENGTH],
-        value[TERM_CONFIG_LENGTH];
     if (configFileName == NULL)
         configFileName = g_strconcat(getenv("HOME"),
                                      TERM_CONFIG_DIR, TERM_NAME, ".conf", NULL);
     else
         defaultConfigFile = FALSE;
-    configFile = fopen(configFileName, "r");
+    /* Kept for watching the file */
+    if (g_strcmp0(configPath, configFileName)) {
+        g_free(configPath);
+        configPath = g_strdup(configFileName);
+    }
+    GMappedFile *configFile = g_mapped_file_new(configFileName, FALSE, NULL);
     if (configFile == NULL) {
         printLog("config file not found. (%s)\n", configFileName);
+        buildKeyTable();
         return;
     }
-    keyCount = 0;
-    while (fgets(buf, TERM_CONFIG_LENGTH, configFile)) {
-        /* Skip lines starting with '#' and invalid lines */
-        if (buf[0] == '#' || strlen(buf) < 4)
-            continue;
-        /* Get option and value from line */
-        sscanf(buf, "%s %s\n", option, value);
-        /* Locale */
-        if (!strncmp(option, "locale", strlen(option))) {
-            termLocale = g_strdup(value);
-            /* Word chars */
-        } else if (!strncmp(option, "char", strlen(option))) {
-            /* Remove '"' from word chars */
-            wordChars = g_strdup(value);
-            wordChars[strlen(wordChars) - 1] = 0;
-            termWordChars = wordChars + 1;
-            /* Action key */
-        } else if (!strncmp(option, "key", strlen(option))) {
-            if (!strncmp(value, "alt", strlen(value)))
-                actionKey = GDK_MOD1_MASK;
-            else
-                actionKey = GDK_SHIFT_MASK;
-            /* Key bindings */
-        } else if (!strncmp(option, "bind", strlen(option) - 1)) {
-            /* Parse the line again for command */
-            sscanf(buf, "%s %[^\n]\n", option, value);
-            /* Split the line and the values */
-            char *key = strtok(value, "~");
-            char *cmd = strtok(NULL, "");
-            if (cmd != NULL) {
-                /* Trim and add to the commands */
-                cmd[strlen(cmd) - 1] = 0;
-                /* Execute option is provided */
-                if (!strcmp(option, "bindx"))
-                    /* Append carriage return to command */
-                    keyBindings[keyCount].cmd =
-                        g_strconcat(g_strdup(cmd + 1), "\r", NULL);
-                else
-                    keyBindings[keyCount].cmd = g_strdup(cmd + 1);
-                /* Internal option is specified */
-                if (!strcmp(option, "bindi"))
-                    /* Set binding as internal*/
-                    keyBindings[keyCount].internal = TRUE;
-                else
-                    keyBindings[keyCount].internal = FALSE;
-                /* Add key binding to the keys */
-                keyBindings[keyCount].key = g_strdup(key);
-                printLog("cmd %d = %s -> \"%s\"\n", keyCount + 1,
-                         keyBindings[keyCount].key,
-                         keyBindings[keyCount].cmd);
-                /* Invalidate associated default bindings */
-                invalidateDefaultBinding(&keyBindings[keyCount]);
-                /* Increment the keys count */
-                keyCount++;
-            }
-            /* Tab position */
-        } else if (!strncmp(option, "tab", strlen(option))) {
-            if (!strncmp(value, "bottom", strlen(value)))
-                tabPosition = 0;
-            else
-                tabPosition = 1;
-            /* Terminal font */
-        } else if (!strncmp(option, "font", strlen(option))) {
-            /* Parse the line again for font size */
-            sscanf(buf, "%s %[^\n]\n", option, value);
-            /* Split the line and get last element */
-            fontSize = strrchr(value, ' ');
-            if (fontSize != NULL) {
-                /* Trim and set the font size */
-                defaultFontSize = atoi(fontSize + 1);
-                /* Get the font information excluding font size */
-                *fontSize = 0;
-                termFont = g_strdup(value);
-            }
-            /* Opacity value */
-        } else if (!strncmp(option, "opacity", strlen(option))) {
-            termOpacity = atof(value);
-            /* Cursor colors */
-        } else if (!strncmp(option, "cursor", strlen(option))) {
-            termCursorColor = parseColor(value);
-        } else if (!strncmp(option, "cursor_foreground", strlen(option))) {
-            termCursorFg = parseColor(value);
-            /* Cursor shape */
-        } else if (!strncmp(option, "cursor_shape", strlen(option))) {
-            if (!strncmp(value, "underline", strlen(value)))
-                termCursorShape = VTE_CURSOR_SHAPE_UNDERLINE;
-            else if (!strncmp(value, "ibeam", strlen(value)))
-                termCursorShape = VTE_CURSOR_SHAPE_IBEAM;
-            else
-                termCursorShape = VTE_CURSOR_SHAPE_BLOCK;
-            /* Foreground color */
-        } else if (!strncmp(option, "foreground", strlen(option))) {
-            termForeground = parseColor(value);
-            /* Bold color */
-        } else if (!strncmp(option, "foreground_bold", strlen(option))) {
-            termBoldColor = parseColor(value);
-            /* Background color */
-        } else if (!strncmp(option, "background", strlen(option))) {
-            termBackground = parseColor(value);
-            /* Color palette */
-        } else if (!strncmp(option, "color", strlen(option) - 2)) {
-            /* Get the color index */
-            char *colorIndex = strrchr(option, 'r');
-            if (colorIndex != NULL) {
-                /* Set the color in palette */
-                termPalette[atoi(colorIndex + 1)] =
-                    CLR_GDK(parseColor(value), 0);
-                colorCount++;
-            }
-        }
+    GArray *oldBindings = keyBindings;
+    GStringChunk *oldStrings = bindingStrings;
+    GPtrArray *oldMatches = matchPatterns;
+    matchPatterns = g_ptr_array_new_with_free_func(freeMatchPattern);
+    keyBindings = g_array_sized_new(FALSE, FALSE, sizeof(Bindings), TERM_CONFIG_LENGTH);
+    bindingStrings = g_string_chunk_new(TERM_BUFFER_SIZE);
+    colorCount = 0;
+    for (int i = 0; i < defaultKeyCount; i++)
+        defaultKeyBindings[i].invalid = FALSE;
+    const char *data = g_mapped_file_get_contents(configFile);
+    const char *end = data + g_mapped_file_get_length(configFile);
+    GString *value = g_string_new(NULL);
+    configLine = 0;
+    for (const char *line = data, *next; line < end; line = next) {
+        const char *eol = memchr(line, '\n', end - line);
+        next = eol != NULL ? eol + 1 : end;
+        configLine++;
+        parseLine(line, eol != NULL ? eol : end, value);
+    }
+    g_string_free(value, TRUE);
+    g_mapped_file_unref(configFile);
+    buildKeyTable();
+    if (oldBindings != NULL) {
+        g_array_free(oldBindings, TRUE);
+        g_string_chunk_free(oldStrings);
     }
-    fclose(configFile);
+    if (oldMatches != NULL)
+        g_ptr_array_unref(oldMatches);
     if (defaultConfigFile)
         g_free(configFileName);
 }
@@ -781,8 +5988,24 @@ static void parseSettings() {
  * \return 1 on exit
  */
 static int parseArgs(int argc, char **argv) {
-    args = argv;
-    while ((opt = getopt(argc, argv, ":c:w:e:t:vdh")) != -1) {
+    static struct option longOptions[] = {
+        { "config", required_argument, NULL, 'c' },
+        { "workdir", required_argument, NULL, 'w' },
+        { "command", required_argument, NULL, 'e' },
+        { "title", required_argument, NULL, 't' },
+        { "server", no_argument, NULL, 's' },
+        { "tab", no_argument, NULL, 'T' },
+        { "background", no_argument, NULL, 'B' },
+        { "bench", no_argument, NULL, 'b' },
+        { "stats", no_argument, NULL, 'S' },
+        { "headless", optional_argument, NULL, 'H' },
+        { "startup-trace", no_argument, NULL, 'P' },
+        { "version", no_argument, NULL, 'v' },
+        { "debug", no_argument, NULL, 'd' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    while ((opt = getopt_long(argc, argv, ":c:w:e:t:sTBbSH::Pvdh", longOptions, NULL)) != -1) {
         switch (opt) {
             case 'c':
                 /* Configuration file name to read */
@@ -800,6 +6023,36 @@ static int parseArgs(int argc, char **argv) {
                 /* Title to set in terminal */
                 termTitle = optarg;
                 break;
+            case 's':
+                /* Run as single-instance server */
+                serverMode = TRUE;
+                break;
+            case 'T':
+                /* Request a new tab from the server */
+                tabRequest = TRUE;
+                break;
+            case 'B':
+                /* Open the tab in the background */
+                backgroundRequest = TRUE;
+                break;
+            case 'b':
+                /* Run the benchmark */
+                benchMode = TRUE;
+                break;
+            case 'H':
+                /* Run without a window, write frames every N ms */
+                headlessMode = TRUE;
+                if (optarg != NULL)
+                    headlessInterval = MAX(atoi(optarg), 0);
+                break;
+            case 'P':
+                /* Print the time of the startup phases */
+                startupTrace = TRUE;
+                break;
+            case 'S':
+                /* Print the stats of the server */
+                statsRequest = TRUE;
+                break;
             case 'd':
                 /* Activate debug messages */
                 debugMessages = TRUE;
@@ -823,7 +6076,7 @@ static int parseArgs(int argc, char **argv) {
                 /* Show help message */
                 fprintf(stderr,
                         "%s[ %susage%s ] %s [-h] "
-                        "[-v] [-d] [-c config] [-t title] [-w workdir] [-e command]%s\n",
+                        "[-v] [-d] [-s] [-T] [-B] [-b] [-S] [-H[frame ms]] [-P] [-c config] [-t title] [-w workdir] [-e command]%s\n",
                         TERM_ATTR_BOLD,
                         TERM_ATTR_COLOR,
                         TERM_ATTR_DEFAULT,
@@ -844,13 +6097,29 @@ static int parseArgs(int argc, char **argv) {
  * Entry-point
  */
 int main(int argc, char *argv[]) {
+    gint64 startTime = g_get_monotonic_time();
     /* Parse command line arguments */
     if (parseArgs(argc, argv))
         return 0;
+    if (startupTrace) {
+        StartupMark mark = { .phase = "start", .time = startTime };
+        startupMarks = g_array_new(FALSE, FALSE, sizeof(StartupMark));
+        g_array_append_val(startupMarks, mark);
+        markStartup("args");
+    }
+    /* Hand the request over to the running server */
+    socketPath = g_build_filename(g_get_user_runtime_dir(), TERM_SOCKET_NAME, NULL);
+    if (statsRequest)
+        return requestStats();
+    if (!serverMode && !benchMode && !headlessMode && configFileName == NULL &&
+        sendRequest() == 0)
+        return 0;
+    markStartup("request");
     /* Parse settings if configuration file exists */
     parseSettings();
+    markStartup("settings");
     /* Initialize GTK and start the terminal */
     gtk_init(&argc, &argv);
-    startTerm();
-    return 0;
+    markStartup("gtk_init");
+    return startTerm();
 }
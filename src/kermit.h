@@ -29,23 +29,148 @@
 #define TERM_CURSOR_COLOR 0xffffff
 #define TERM_CURSOR_FG 0xffffff
 #define TERM_PALETTE_SIZE 256
+#define TERM_SCROLLBACK 10000
+#define TERM_CELL_SIZE 16
 #define TERM_CONFIG_LENGTH 64
 #define TERM_CONFIG_DIR "/.config/"
+#define TERM_CONFIG_SLOTS 128
+#define TERM_CONFIG_HASH(first, last, len) \
+    (((first) + (last) * 44 + (len)) & (TERM_CONFIG_SLOTS - 1))
+#define TERM_SOCKET_NAME "kermit.sock"
+#define TERM_DATA_FONT_SIZE "kermit-font-size"
+#define TERM_DATA_ZOOM "kermit-zoom"
+#define TERM_DATA_GENERATION "kermit-generation"
+#define TERM_DATA_SPAWN_TIME "kermit-spawn-time"
+#define TERM_DATA_LAZY "kermit-lazy"
+#define TERM_DATA_BACKGROUND "kermit-background"
+#define TERM_DATA_DIR "kermit-dir"
+#define TERM_DATA_COMMAND "kermit-command"
+#define TERM_DATA_LOG "kermit-log"
+#define TERM_DATA_SEARCH "kermit-search"
+#define TERM_DATA_BROADCAST "kermit-broadcast"
+#define TERM_DATA_PASTE "kermit-paste"
+#define TERM_DATA_SEEN "kermit-seen"
+#define TERM_DATA_HIBERNATED "kermit-hibernated"
+#define TERM_DATA_PID "kermit-pid"
+#define TERM_DATA_SAMPLE "kermit-sample"
+#define TERM_DATA_SPLIT "kermit-split"
+#define TERM_DATA_RATIO "kermit-ratio"
+#define TERM_DATA_SETTLE "kermit-settle"
+#define TERM_DATA_COLUMNS "kermit-columns"
+#define TERM_DATA_SLAVE "kermit-slave"
+#define TERM_DATA_OUTPUT "kermit-output"
+#define TERM_DATA_WIDTH "kermit-width"
+#define TERM_DATA_SUSPENDED "kermit-suspended"
+#define TERM_DATA_MATCH "kermit-match"
+#define TERM_THROTTLE_SLICE 4
+#define TERM_HIBERNATE_CHECK 60
+#define TERM_SESSION_NAME "session"
+#define TERM_SESSION_MAGIC "KSS1"
+#define TERM_SESSION_END "KSSE"
+#define TERM_SESSION_VERSION 2
+#define TERM_SESSION_ACTIVE 1
+#define TERM_SESSION_MAX (4 << 20)
+#define TERM_STAT_BUCKETS 24
+#define TERM_TRACE_MAX 65536
+#define TERM_PRESPAWN_MAX 16
+#define TERM_BENCH_SIZE (4 << 20)
+#define TERM_BENCH_SAMPLES 100
+#define TERM_BENCH_TIMEOUT 120
+#define TERM_HEADLESS_COLUMNS 80
+#define TERM_HEADLESS_ROWS 24
+#define TERM_BUFFER_SIZE 4096
+#define TERM_RELOAD_DELAY 250
+#define TERM_SHELL "/bin/sh"
+#define TERM_BROADCAST_MAX (1 << 20)
+#define TERM_MATCH_URL "\\b(?:https?|ftp|file)://[^\\s<>\"'`]*[^\\s<>\"'`.,;:!?)\\]]"
+#define TERM_MATCH_COMMAND "xdg-open"
+#define TERM_PASTE_STREAM (64 << 10)
+#define TERM_PASTE_CHUNK (16 << 10)
+#define TERM_PASTE_START "\033[200~"
+#define TERM_PASTE_END "\033[201~"
+#define TERM_PASTE_WAIT 20
+#define TERM_REWRAP_OFF 0
+#define TERM_REWRAP_ON 1
+#define TERM_REWRAP_LAZY 2
+#define TERM_RENDER_AUTO 0
+#define TERM_RENDER_OPAQUE 1
+#define TERM_RENDER_ALPHA 2
+#define TERM_RESIZE_DELAY 150
+#define TERM_SPLIT_SCALE 1000
+#define TERM_SPLIT_DELAY 100
+#define TERM_SPLIT_MAX 64
+#define TERM_SEARCH_CHUNK 1000
+#define TERM_SEARCH_DELAY 150
+#define TERM_LOG_BUFFER (1 << 20)
+#define TERM_LOG_OPEN 0
+#define TERM_LOG_WRITE 1
+#define TERM_LOG_CLOSE 2
+#define TERM_LOG_QUIT 3
+#define TERM_LOG_SESSION 4
+#define TERM_LOG_DROPPED "[%ld rows are not logged]\n"
+#define TERM_CHANGE_THEME 1
+#define TERM_CHANGE_OPTIONS 2
+#define TERM_CHANGE_ALL (TERM_CHANGE_THEME | TERM_CHANGE_OPTIONS)
+#define TERM_REQUEST_MAX 65536
+#define TERM_REQUEST_TIMEOUT 5
 #define TERM_ATTR_OFF "\x1b[0m"
 #define TERM_ATTR_BOLD "\x1b[1m"
 #define TERM_ATTR_COLOR "\x1b[34m"
 #define TERM_ATTR_DEFAULT "\x1b[39m"
 
-static GtkWidget *getTerm();
+typedef struct TermWindow TermWindow;
+typedef struct SessionSnapshot SessionSnapshot;
+
+static GtkWidget *getTerm(const char *dir, const char *cmd);
 static void parseSettings();
 static int configureTerm(GtkWidget *term);
 static int setTermFont(GtkWidget *term, int fontSize);
+static int getTermFontSize(GtkWidget *term);
 static gboolean termOnChildExit(VteTerminal *term,
                                 gint status, gpointer userData);
 static gboolean termOnKeyPress(GtkWidget *widget,
                                GdkEventKey *key, gpointer gptr);
 static gboolean termOnTitleChanged(GtkWidget *term,
                                    gpointer gptr);
+static gboolean termOnButtonPress(GtkWidget *widget,
+                                  GdkEventButton *event, gpointer userData);
 static gboolean termOnResize(GtkWidget *widget,
                              GtkAllocation *allocation,
                              gpointer userData);
+static void scheduleConfig(guint changes);
+static void reloadConfig();
+static void startLog(GtkWidget *terminal);
+static void stopLog(GtkWidget *terminal);
+static void showSearch(TermWindow *termWindow);
+static void cancelSearch(TermWindow *termWindow);
+static gboolean searchOnResult(gpointer userData);
+static GtkWidget *getPageTerm(GtkWidget *page);
+static void holdRewrap(GtkWidget *terminal);
+static void releaseRewrap(GtkWidget *terminal);
+static void thawPage(GtkWidget *page);
+static int getSeconds();
+static void toggleBroadcast(GtkWidget *terminal);
+static gboolean isBroadcastPage(GtkWidget *page);
+static void pasteOnText(GtkClipboard *clipboard, const gchar *text, gpointer userData);
+static void stopPaste(TermWindow *termWindow);
+static gboolean pasteOnWait(gpointer userData);
+static void splitTerm(GtkWidget *terminal, GtkOrientation orientation);
+static gboolean closePane(GtkWidget *terminal);
+static void updateThrottle();
+static void setTermOptions(GtkWidget *terminal);
+static void schedulePoolRefill();
+static void spawnLazyTab(GtkWidget *page);
+static void forEachTerm(GtkWidget *widget, gpointer func);
+static void releaseTerm(GtkWidget *terminal);
+static void termOnAllocate(GtkWidget *widget, GtkAllocation *allocation,
+                           gpointer userData);
+static gboolean termTabOnSwitch(GtkNotebook *notebook, GtkWidget *page,
+                                guint pageNum, gpointer userData);
+static void appendTab(TermWindow *termWindow, const char *dir, const char *cmd);
+static void createBars(TermWindow *termWindow);
+static void writeSession(SessionSnapshot *snapshot);
+static void freeSessionSnapshot(SessionSnapshot *snapshot);
+static gboolean termTabOnAdd(GtkNotebook *notebook, GtkWidget *child,
+                             guint pageNum, gpointer userData);
+static TermWindow *newWindow(const char *dir, const char *cmd,
+                             const char *title);